@@ -0,0 +1,386 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "src/chip8.h"
+
+
+// Static recompiler: translates a ROM into a C++ translation unit defining a
+// CompiledProgram (see compiled.h) for it.
+//
+// Control flow is recovered by following every path from the entry point:
+// jumps, calls and the return points after them, both sides of skips, and
+// Fx0A (which re-executes until a key is pressed). Each reachable basic
+// block becomes a label in one function; jumps between blocks are gotos, and
+// returns (00EE) and computed jumps (Bnnn) go through a switch on pc_ over
+// the block entries. Anything else is left to the interpreter: pc_ that
+// isn't a block entry, code outside the ROM, and unknown opcodes, as well as
+// all code once the ROM writes over its own compiled instructions.
+
+struct Rom {
+  std::string name;
+  std::vector<uint8_t> bytes;
+
+  bool Contains(const int address) const {
+    const int i = address - Chip8::kProgramAddress_;
+    return 0 <= i && i + 1 < static_cast<int>(bytes.size());
+  }
+
+  uint16_t Opcode(const int address) const {
+    const int i = address - Chip8::kProgramAddress_;
+    return bytes[i] << 8 | bytes[i + 1];
+  }
+};
+
+// Addresses control can continue at after the instruction at address, and
+// whether each starts a new block; false if the instruction is left to the
+// interpreter
+static bool Successors(const uint16_t opcode, const int address,
+                       std::vector<int>* successors, bool* branches) {
+  const int nnn = opcode & 0x0FFF;
+  successors->clear();
+  *branches = true;
+  switch (Chip8::DecodeInstruction(opcode)) {
+    case Chip8::kOp00EE: case Chip8::kOpBnnn: return true;
+    case Chip8::kOp1nnn: successors->push_back(nnn); return true;
+    case Chip8::kOp2nnn: {
+      successors->push_back(nnn);
+      successors->push_back(address + 2);
+      return true;
+    }
+    case Chip8::kOp3xkk: case Chip8::kOp4xkk: case Chip8::kOp5xy0:
+    case Chip8::kOp9xy0: case Chip8::kOpEx9E: case Chip8::kOpExA1: {
+      successors->push_back(address + 2);
+      successors->push_back(address + 4);
+      return true;
+    }
+    case Chip8::kOpFx0A: {
+      successors->push_back(address);
+      successors->push_back(address + 2);
+      return true;
+    }
+    case Chip8::kOpUnknown: return false;
+    default: {
+      successors->push_back(address + 2);
+      *branches = false;
+      return true;
+    }
+  }
+}
+
+// Statement continuing execution at address
+static std::string Goto(const std::vector<bool>& reached, const int address) {
+  char statement[64];
+  if (0 <= address && address < Chip8::kMemorySize_ && reached[address]) {
+    std::snprintf(statement, sizeof(statement), "goto block_%03X;", address);
+  } else {
+    std::snprintf(statement, sizeof(statement),
+                  "{ c->pc_ = 0x%03X; return executed; }", address);
+  }
+  return statement;
+}
+
+// Translate one instruction; `after` is how many instructions of its block
+// follow it
+static void EmitInstruction(FILE* out, const std::vector<bool>& reached,
+                            const int address, const uint16_t opcode,
+                            const int after) {
+  const int x = (opcode >> 8) & 0x000F;
+  const int y = (opcode >> 4) & 0x000F;
+  const int kk = opcode & 0x00FF;
+  const int nnn = opcode & 0x0FFF;
+  const std::string skip = Goto(reached, address + 4);
+  const std::string next = Goto(reached, address + 2);
+
+  std::fprintf(out, "  // 0x%03X: %04X\n", address, opcode);
+  switch (Chip8::DecodeInstruction(opcode)) {
+    case Chip8::kOp00EE: {
+      std::fprintf(out,
+        "  c->pc_ = c->stack_[--c->sp_ & 0x%X];\n"
+        "  goto dispatch;\n", Chip8::kStackSize_ - 1);
+      break;
+    }
+    case Chip8::kOp1nnn: {
+      std::fprintf(out, "  %s\n", Goto(reached, nnn).c_str());
+      break;
+    }
+    case Chip8::kOp2nnn: {
+      std::fprintf(out,
+        "  c->stack_[c->sp_++ & 0x%X] = 0x%03X;\n"
+        "  %s\n", Chip8::kStackSize_ - 1, address + 2,
+        Goto(reached, nnn).c_str());
+      break;
+    }
+    case Chip8::kOp3xkk: case Chip8::kOp4xkk: {
+      std::fprintf(out, "  if (v[0x%X] %s 0x%02X) %s\n  %s\n",
+                   x, (opcode & 0xF000) == 0x3000 ? "==" : "!=", kk,
+                   skip.c_str(), next.c_str());
+      break;
+    }
+    case Chip8::kOp5xy0: case Chip8::kOp9xy0: {
+      std::fprintf(out, "  if (v[0x%X] %s v[0x%X]) %s\n  %s\n",
+                   x, (opcode & 0xF000) == 0x5000 ? "==" : "!=", y,
+                   skip.c_str(), next.c_str());
+      break;
+    }
+    case Chip8::kOp6xkk: std::fprintf(out, "  v[0x%X] = 0x%02X;\n", x, kk); break;
+    case Chip8::kOp7xkk: std::fprintf(out, "  v[0x%X] += 0x%02X;\n", x, kk); break;
+    case Chip8::kOp8xy0: std::fprintf(out, "  v[0x%X] = v[0x%X];\n", x, y); break;
+    case Chip8::kOp8xy1: std::fprintf(out, "  v[0x%X] |= v[0x%X];\n", x, y); break;
+    case Chip8::kOp8xy2: std::fprintf(out, "  v[0x%X] &= v[0x%X];\n", x, y); break;
+    case Chip8::kOp8xy3: std::fprintf(out, "  v[0x%X] ^= v[0x%X];\n", x, y); break;
+    case Chip8::kOp8xy4: {
+      std::fprintf(out,
+        "  { const int res = v[0x%X] + v[0x%X];\n"
+        "    v[0x%X] = res; v[0xF] = res > 0xFF; }\n", x, y, x);
+      break;
+    }
+    case Chip8::kOp8xy5: case Chip8::kOp8xy7: {
+      const int a = (opcode & 0x000F) == 0x0005 ? x : y;
+      const int b = (opcode & 0x000F) == 0x0005 ? y : x;
+      if (x == y) {
+        std::fprintf(out, "  v[0x%X] = 0x00; v[0xF] = 1;\n", x);
+        break;
+      }
+      std::fprintf(out,
+        "  { const uint8_t no_borrow = v[0x%X] >= v[0x%X];\n"
+        "    v[0x%X] = v[0x%X] - v[0x%X]; v[0xF] = no_borrow; }\n",
+        a, b, x, a, b);
+      break;
+    }
+    case Chip8::kOp8xy6: {
+      std::fprintf(out,
+        "  { const uint8_t lsb = v[0x%X] & 0x01;\n"
+        "    v[0x%X] >>= 1; v[0xF] = lsb; }\n", x, x);
+      break;
+    }
+    case Chip8::kOp8xyE: {
+      std::fprintf(out,
+        "  { const uint8_t msb = v[0x%X] >> 7;\n"
+        "    v[0x%X] <<= 1; v[0xF] = msb; }\n", x, x);
+      break;
+    }
+    case Chip8::kOpAnnn: std::fprintf(out, "  c->index_ = 0x%03X;\n", nnn); break;
+    case Chip8::kOpBnnn: {
+      std::fprintf(out, "  c->pc_ = 0x%03X + v[0x0];\n  goto dispatch;\n", nnn);
+      break;
+    }
+    case Chip8::kOpEx9E: case Chip8::kOpExA1: {
+      std::fprintf(out, "  if (%sc->KeyIsPressed(v[0x%X])) %s\n"
+                   "  %s\n", kk == 0x9E ? "" : "!", x,
+                   skip.c_str(), next.c_str());
+      break;
+    }
+    case Chip8::kOpFx07: {
+      std::fprintf(out, "  v[0x%X] = c->delay_timer_;\n", x);
+      break;
+    }
+    case Chip8::kOpFx0A: {
+      std::fprintf(out,
+        "  c->pc_ = 0x%03X;\n"
+        "  c->DispatchInstruction(0x%04X);\n"
+        "  if (c->pc_ == 0x%03X) %s\n"
+        "  %s\n", address, opcode, address,
+        Goto(reached, address).c_str(), next.c_str());
+      break;
+    }
+    case Chip8::kOpFx15: {
+      std::fprintf(out, "  c->delay_timer_ = v[0x%X];\n", x);
+      break;
+    }
+    case Chip8::kOpFx18: {
+      std::fprintf(out, "  c->sound_timer_ = v[0x%X];\n", x);
+      break;
+    }
+    case Chip8::kOpFx1E: std::fprintf(out, "  c->index_ += v[0x%X];\n", x); break;
+    case Chip8::kOpFx29: {
+      std::fprintf(out, "  c->index_ = %d*v[0x%X];\n",
+                   Chip8::kBytesPerFontSprite_, x);
+      break;
+    }
+    case Chip8::kOpFx33: case Chip8::kOpFx55: {
+      // May write over compiled code
+      std::fprintf(out,
+        "  c->DispatchInstruction(0x%04X);\n"
+        "  if (c->compiled_stale_) {\n"
+        "    c->pc_ = 0x%03X;\n"
+        "    return executed - %d;\n"
+        "  }\n", opcode, address + 2, after);
+      break;
+    }
+    case Chip8::kOpFx65: {
+      std::fprintf(out,
+        "  for (int i = 0; i <= 0x%X; ++i) v[i] = c->ByteAt(c->index_ + i);\n",
+        x);
+      break;
+    }
+    default: {  // 00E0, Cxkk, Dxyn
+      std::fprintf(out, "  c->DispatchInstruction(0x%04X);\n", opcode);
+    }
+  }
+}
+
+static void Compile(const Rom& rom, FILE* out) {
+  // Recover control flow
+  std::vector<bool> reached(Chip8::kMemorySize_, false);
+  std::vector<bool> leader(Chip8::kMemorySize_, false);
+  std::vector<int> worklist(1, Chip8::kProgramAddress_);
+  leader[Chip8::kProgramAddress_] = true;
+  std::vector<int> successors;
+  while (!worklist.empty()) {
+    const int address = worklist.back();
+    worklist.pop_back();
+    if (!rom.Contains(address) || reached[address]) continue;
+
+    bool branches;
+    if (!Successors(rom.Opcode(address), address, &successors, &branches)) {
+      continue;
+    }
+    reached[address] = true;
+    for (const int successor : successors) {
+      if (0 <= successor && successor < Chip8::kMemorySize_) {
+        leader[successor] = leader[successor] || branches;
+        worklist.push_back(successor);
+      }
+    }
+  }
+
+  std::vector<uint8_t> code(rom.bytes.size(), 0);
+  int num_instructions = 0, num_blocks = 0;
+  bool computed_jumps = false;  // Whether Run needs the switch on pc_ again
+  for (int address = 0; address < Chip8::kMemorySize_; ++address) {
+    if (!reached[address]) continue;
+    code[address - Chip8::kProgramAddress_] = 1;
+    code[address + 1 - Chip8::kProgramAddress_] = 1;
+    ++num_instructions;
+    if (leader[address]) ++num_blocks;
+    const Chip8::Opcode op = Chip8::DecodeInstruction(rom.Opcode(address));
+    computed_jumps |= op == Chip8::kOp00EE || op == Chip8::kOpBnnn;
+  }
+
+  // Header, ROM and code map
+  std::fprintf(out,
+    "// Generated by chip8_aot from %s; do not edit\n"
+    "// %d instructions in %d blocks\n"
+    "#include \"src/chip8.h\"\n"
+    "#include \"src/compiled.h\"\n"
+    "\n"
+    "\n"
+    "namespace {\n"
+    "\n", rom.name.c_str(), num_instructions, num_blocks);
+  const struct { const char* name; const std::vector<uint8_t>& bytes; }
+    arrays[] = { {"kRom", rom.bytes}, {"kCode", code} };
+  for (const auto& array : arrays) {
+    std::fprintf(out, "const uint8_t %s[] = {", array.name);
+    for (size_t i = 0; i < array.bytes.size(); ++i) {
+      std::fprintf(out, "%s0x%02X%s", i % 12 ? " " : "\n  ",
+                   array.bytes[i], i + 1 < array.bytes.size() ? "," : "\n");
+    }
+    std::fprintf(out, "};\n\n");
+  }
+
+  std::fprintf(out,
+    "class Program : public CompiledProgram {\n"
+    " public:\n"
+    "  Program() : CompiledProgram(\"%s\", kRom, sizeof(kRom), kCode) {}\n"
+    "  int Run(Chip8* c, const int count) const;\n"
+    "};\n"
+    "\n"
+    "int Program::Run(Chip8* c, const int count) const {\n"
+    "  uint8_t* const v = c->v_;\n"
+    "  int executed = 0;\n"
+    "\n"
+    "%s"
+    "  switch (c->pc_) {\n", rom.name.c_str(),
+    computed_jumps ? " dispatch:\n" : "");
+  for (int address = 0; address < Chip8::kMemorySize_; ++address) {
+    if (reached[address] && leader[address]) {
+      std::fprintf(out, "    case 0x%03X: goto block_%03X;\n", address, address);
+    }
+  }
+  std::fprintf(out,
+    "    default: return executed;\n"
+    "  }\n");
+
+  // Blocks; each runs whole or not at all, so it checks the budget first
+  for (int start = 0; start < Chip8::kMemorySize_; ++start) {
+    if (!reached[start] || !leader[start]) continue;
+
+    std::vector<int> block;
+    bool branches = false;
+    for (int address = start;
+         reached[address] && (address == start || !leader[address]);
+         address += 2) {
+      block.push_back(address);
+      Successors(rom.Opcode(address), address, &successors, &branches);
+      if (branches || address + 2 >= Chip8::kMemorySize_) break;
+    }
+    const int length = block.size();
+
+    std::fprintf(out,
+      "\n"
+      " block_%03X:\n"
+      "  if (count - executed < %d) {\n"
+      "    c->pc_ = 0x%03X;\n"
+      "    return executed;\n"
+      "  }\n"
+      "  executed += %d;\n", start, length, start, length);
+    for (int i = 0; i < length; ++i) {
+      EmitInstruction(out, reached, block[i], rom.Opcode(block[i]),
+                      length - 1 - i);
+    }
+    if (!branches) {
+      std::fprintf(out, "  %s\n", Goto(reached, block.back() + 2).c_str());
+    }
+  }
+
+  std::fprintf(out,
+    "}\n"
+    "\n"
+    "const Program kProgram;\n"
+    "\n"
+    "}  // namespace\n");
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::printf(
+      "Usage: chip8_aot ROM OUTPUT\n"
+      "  Compile ROM ahead of time to the C++ translation unit OUTPUT;\n"
+      "  build it into chip8 to run the ROM natively with `-d compiled`.\n");
+    return EXIT_FAILURE;
+  }
+
+  Rom rom;
+  const std::string path = argv[1];
+  const size_t slash = path.find_last_of('/');
+  for (const char ch : path.substr(slash == std::string::npos ? 0 : slash + 1)) {
+    if (ch != '"' && ch != '\\' && ch >= ' ') rom.name += ch;
+  }
+  FILE* program = std::fopen(path.c_str(), "rb");
+  if (!program) {
+    std::fprintf(stderr, "chip8_aot: file does not exist: %s\n", path.c_str());
+    return EXIT_FAILURE;
+  }
+  rom.bytes.resize(Chip8::kMaxProgramSize_);
+  rom.bytes.resize(
+    std::fread(rom.bytes.data(), 1, Chip8::kMaxProgramSize_, program));
+  std::fclose(program);
+
+  FILE* out = std::fopen(argv[2], "w");
+  if (!out) {
+    std::fprintf(stderr, "chip8_aot: can't write %s\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  Compile(rom, out);
+  std::fclose(out);
+
+  return 0;
+}
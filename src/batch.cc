@@ -0,0 +1,409 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "src/chip8.h"
+
+
+// A ROM to run headless for `frames` frames, holding keys as the input
+// script says, and what came of it
+struct Job {
+  std::string rom;
+  std::string input;  // Path to the input script, or empty
+  std::vector<std::pair<int, uint16_t> > events;  // (frame, keys held from it)
+  int frames;
+
+  std::string status;  // "ok", or why the job didn't run to the end
+  bool ran;  // Whether it started, so there are hashes
+  uint64_t state_hash, screen_hash;
+  double seconds;
+};
+
+// Keys held down, changed between frames by the batch runner
+class ScriptedKeyboard : public KeyboardInterface {
+ public:
+  ScriptedKeyboard() : keys_(0) {}
+  uint16_t PressedKeys() { return keys_; }
+  uint16_t keys_;
+};
+
+// One queue of jobs per worker; a worker takes jobs from the back of its own
+// queue and, when that runs dry, steals from the front of the others'
+class WorkStealingQueues {
+ public:
+  explicit WorkStealingQueues(const int num_workers)
+    : num_workers_(num_workers), queues_(new Queue[num_workers]) {}
+  ~WorkStealingQueues() { delete[] queues_; }
+
+  void Push(const int worker, const int job) {
+    std::lock_guard<std::mutex> lock(queues_[worker].mutex);
+    queues_[worker].jobs.push_back(job);
+  }
+
+  // Next job for `worker`; false once every queue is empty
+  bool Pop(const int worker, int* job) {
+    for (int i = 0; i < num_workers_; ++i) {
+      Queue& queue = queues_[(worker + i)%num_workers_];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.jobs.empty()) continue;
+      if (i == 0) {
+        *job = queue.jobs.back();
+        queue.jobs.pop_back();
+      } else {
+        *job = queue.jobs.front();
+        queue.jobs.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<int> jobs;
+  };
+  const int num_workers_;
+  Queue* queues_;
+};
+
+void RunJob(Job* job, const Chip8::Dispatch dispatch, const double ips,
+            const uint64_t seed) {
+  ScriptedKeyboard* keyboard = new ScriptedKeyboard();
+  Chip8 chip8(new NullDisplay(), new NullSound(), keyboard);
+  chip8.tracing_ = Chip8::kNoTracing;
+  chip8.dispatch_ = dispatch;
+  chip8.instructions_per_second_ = ips;
+  chip8.random_.Seed(seed);
+  chip8.exit_on_unknown_ = false;
+  chip8.LoadProgram(job->rom);
+
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+  size_t event = 0;
+  for (int frame = 0; frame < job->frames; ++frame) {
+    while (event < job->events.size() && job->events[event].first <= frame) {
+      keyboard->keys_ = job->events[event++].second;
+    }
+    chip8.EmulateCycle();
+    if (chip8.unknown_opcode_ >= 0) {
+      char status[64];
+      std::snprintf(status, sizeof(status), "unknown_opcode_%04X@frame_%d",
+                    chip8.unknown_opcode_, frame);
+      job->status = status;
+      break;
+    }
+  }
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+
+  job->state_hash = chip8.StateHash();
+  job->screen_hash = chip8.ScreenHash();
+  job->seconds = elapsed.count();
+  job->ran = true;
+}
+
+// Input script: lines of `FRAME KEYS`, holding KEYS (hex digits of the
+// Chip-8 keys, or `-` for none) from FRAME on; `#` starts a comment. False,
+// with the job's status saying why, if it can't be read
+bool ReadInputScript(Job* job) {
+  std::ifstream script(job->input);
+  if (!script) {
+    std::fprintf(stderr, "In ReadInputScript: file does not exist: %s\n",
+                 job->input.c_str());
+    job->status = "missing_input";
+    return false;
+  }
+
+  std::string line;
+  for (int number = 1; std::getline(script, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    int frame;
+    std::string keys;
+    if (!(fields >> frame)) continue;  // Blank
+    uint16_t held = 0;
+    if (!(fields >> keys) || frame < 0
+     || (keys != "-"
+      && keys.find_first_not_of("0123456789abcdefABCDEF")
+         != std::string::npos)) {
+      std::fprintf(stderr, "In ReadInputScript: bad line %d of %s\n", number,
+                   job->input.c_str());
+      job->status = "bad_input";
+      return false;
+    }
+    for (char key : keys) {
+      if (key != '-') held |= 1 << std::stoi(std::string(1, key), NULL, 16);
+    }
+    job->events.push_back(std::make_pair(frame, held));
+  }
+  std::stable_sort(
+    job->events.begin(), job->events.end(),
+    [](const std::pair<int, uint16_t>& a, const std::pair<int, uint16_t>& b) {
+      return a.first < b.first;
+    });
+  return true;
+}
+
+// Without leading and trailing whitespace
+std::string Trim(const std::string& field) {
+  const size_t begin = field.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) return "";
+  return field.substr(begin, field.find_last_not_of(" \t\r\n") + 1 - begin);
+}
+
+// Manifest: lines of `ROM[,INPUT_SCRIPT[,FRAMES]]`, paths relative to the
+// manifest; `#` starts a comment. A job whose FRAMES isn't a positive
+// integer is kept, with status `bad_frames`
+void ReadManifest(const std::string& path, const int frames,
+                  std::vector<Job>* jobs) {
+  std::ifstream manifest(path);
+  if (!manifest) {
+    std::fprintf(stderr, "In ReadManifest: file does not exist: %s\n",
+                 path.c_str());
+    std::exit(EXIT_FAILURE);
+  }
+  const size_t slash = path.find_last_of('/');
+  const std::string directory
+    = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  auto Resolve = [&directory](const std::string& file) {
+    return (file.empty() || file[0] == '/') ? file : directory + file;
+  };
+
+  std::string line;
+  while (std::getline(manifest, line)) {
+    line = Trim(line.substr(0, line.find('#')));
+    if (line.empty()) continue;
+
+    std::vector<std::string> fields;
+    std::istringstream stream(line);
+    for (std::string field; std::getline(stream, field, ',');) {
+      fields.push_back(Trim(field));
+    }
+    Job job;
+    job.rom = Resolve(fields[0]);
+    job.input = fields.size() > 1 ? Resolve(fields[1]) : "";
+    job.frames = frames;
+    if (fields.size() > 2 && !fields[2].empty()) {
+      const char* begin = fields[2].c_str();
+      char* end;
+      errno = 0;
+      const long value = std::strtol(begin, &end, 10);  // NOLINT
+      if (end == begin || *end != '\0' || errno == ERANGE || value <= 0
+       || value > INT_MAX) {
+        std::fprintf(stderr, "In ReadManifest: bad frame count %s in %s\n",
+                     begin, path.c_str());
+        job.frames = 0;
+        job.status = "bad_frames";
+      } else {
+        job.frames = static_cast<int>(value);
+      }
+    }
+    jobs->push_back(job);
+  }
+}
+
+// Every .ch8 file in a directory, by name
+void ReadDirectory(const std::string& path, const int frames,
+                   std::vector<Job>* jobs) {
+  DIR* directory = opendir(path.c_str());
+  if (!directory) {
+    std::fprintf(stderr, "In ReadDirectory: cannot read %s\n", path.c_str());
+    std::exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> roms;
+  for (dirent* entry = readdir(directory); entry; entry = readdir(directory)) {
+    const std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".ch8") == 0) {
+      roms.push_back(name);
+    }
+  }
+  closedir(directory);
+
+  std::sort(roms.begin(), roms.end());
+  for (const std::string& rom : roms) {
+    Job job;
+    job.rom = path + (path.back() == '/' ? "" : "/") + rom;
+    job.frames = frames;
+    jobs->push_back(job);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int frames = 3000;
+  double ips = Chip8::kDefaultInstructionsPerSecond_;
+  uint64_t seed = Chip8::kDefaultSeed_;
+  // The fastest engine `chip8_bench --validate` checks against `switch`;
+  // ROMs without code built in by chip8_aot run `cached`
+  Chip8::Dispatch dispatch = Chip8::kCompiledDispatch;
+  bool dispatch_valid = true;
+  int num_threads = std::thread::hardware_concurrency();
+  std::string output;
+  std::vector<std::string> sources;
+  for (int i = 1; i < argc; ++i) {
+    if ( (!std::strcmp(argv[i], "-n") || !std::strcmp(argv[i], "--frames"))
+      && i + 1 < argc ) {
+      frames = std::atoi(argv[++i]);
+    } else if ( (!std::strcmp(argv[i], "-s")
+              || !std::strcmp(argv[i], "--ips")) && i + 1 < argc ) {
+      ips = std::atof(argv[++i]);
+    } else if ( (!std::strcmp(argv[i], "-sd")
+              || !std::strcmp(argv[i], "--seed")) && i + 1 < argc ) {
+      seed = std::strtoull(argv[++i], NULL, 0);
+    } else if ( (!std::strcmp(argv[i], "-d")
+              || !std::strcmp(argv[i], "--dispatch")) && i + 1 < argc ) {
+      const std::string engine = argv[++i];
+      if (engine == "switch") {
+        dispatch = Chip8::kSwitchDispatch;
+      } else if (engine == "table") {
+        dispatch = Chip8::kTableDispatch;
+      } else if (engine == "cached") {
+        dispatch = Chip8::kCachedDispatch;
+      } else if (engine == "fused") {
+        dispatch = Chip8::kFusedDispatch;
+      } else if (engine == "jit") {
+        dispatch = Chip8::kJitDispatch;
+      } else if (engine == "compiled") {
+        dispatch = Chip8::kCompiledDispatch;
+      } else {
+        dispatch_valid = false;
+      }
+    } else if ( (!std::strcmp(argv[i], "-j")
+              || !std::strcmp(argv[i], "--threads")) && i + 1 < argc ) {
+      num_threads = std::atoi(argv[++i]);
+    } else if ( (!std::strcmp(argv[i], "-o")
+              || !std::strcmp(argv[i], "--output")) && i + 1 < argc ) {
+      output = argv[++i];
+    } else {
+      sources.push_back(argv[i]);
+    }
+  }
+
+  if (sources.empty() || frames <= 0 || !(ips > 0.) || !dispatch_valid) {
+    std::printf(
+      "Usage: chip8_batch [ -n (--frames) FRAMES; default=3000; ]\n"
+      "                   [ -s (--ips) IPS; default=1080; ]\n"
+      "                   [ -sd (--seed) SEED; default=0x43484950; ]\n"
+      "                   [ -d (--dispatch) switch|table|cached|fused|jit|\n"
+      "                     compiled; default=compiled; ]\n"
+      "                   [ -j (--threads) THREADS; default=all cores; ]\n"
+      "                   [ -o (--output) FILE; default=stdout; ]\n"
+      "                   ROM_DIRECTORY|MANIFEST [...]\n"
+      "  Run every .ch8 ROM in ROM_DIRECTORY, or every job in MANIFEST,\n"
+      "  headless across THREADS threads, and print each job's final state\n"
+      "  hash, screen hash, run time and status (ok, or why it failed).\n"
+      "  MANIFEST lines are ROM[,INPUT_SCRIPT[,FRAMES]]; INPUT_SCRIPT lines\n"
+      "  are FRAME KEYS, holding KEYS (hex digits, or - for none) from FRAME\n"
+      "  on. A job's hashes depend only on the ROM, IPS, SEED and\n"
+      "  INPUT_SCRIPT, not on the dispatch engine.\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Job> jobs;
+  for (const std::string& source : sources) {
+    struct stat info;
+    if (stat(source.c_str(), &info) != 0) {
+      std::fprintf(stderr, "chip8_batch: file does not exist: %s\n",
+                   source.c_str());
+      return EXIT_FAILURE;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      ReadDirectory(source, frames, &jobs);
+    } else {
+      ReadManifest(source, frames, &jobs);
+    }
+  }
+  // Jobs that can't run are reported with the rest rather than stopping
+  // the whole batch
+  std::vector<int> runnable;
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    Job& job = jobs[j];
+    job.ran = false;
+    if (!job.status.empty()) continue;  // Already failed in the manifest
+    job.status = "ok";
+    FILE* rom = std::fopen(job.rom.c_str(), "rb");
+    if (!rom) {
+      std::fprintf(stderr, "chip8_batch: file does not exist: %s\n",
+                   job.rom.c_str());
+      job.status = "missing_rom";
+      continue;
+    }
+    std::fclose(rom);
+    if (!job.input.empty() && !ReadInputScript(&job)) continue;
+    runnable.push_back(j);
+  }
+
+  // Deal the jobs out round-robin, then let idle workers steal
+  num_threads = std::max(1, std::min(num_threads,
+                                     static_cast<int>(runnable.size())));
+  WorkStealingQueues queues(num_threads);
+  for (size_t j = 0; j < runnable.size(); ++j) {
+    queues.Push(j%num_threads, runnable[j]);
+  }
+
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int worker = 0; worker < num_threads; ++worker) {
+    workers.push_back(std::thread(
+      [&queues, &jobs, worker, dispatch, ips, seed]() {
+        int job;
+        while (queues.Pop(worker, &job)) {
+          RunJob(&jobs[job], dispatch, ips, seed);
+        }
+      }));
+  }
+  for (std::thread& worker : workers) worker.join();
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+
+  FILE* out = output.empty() ? stdout : std::fopen(output.c_str(), "w");
+  if (!out) {
+    std::fprintf(stderr, "chip8_batch: cannot write %s\n", output.c_str());
+    return EXIT_FAILURE;
+  }
+  std::fprintf(out, "rom\tinput\tframes\tstate_hash\tscreen_hash\tseconds"
+               "\tstatus\n");
+  int failed = 0;
+  for (const Job& job : jobs) {
+    const char* input = job.input.empty() ? "-" : job.input.c_str();
+    if (job.status != "ok") ++failed;
+    if (!job.ran) {
+      std::fprintf(out, "%s\t%s\t%d\t-\t-\t-\t%s\n", job.rom.c_str(), input,
+                   job.frames, job.status.c_str());
+      continue;
+    }
+    std::fprintf(out, "%s\t%s\t%d\t%016llx\t%016llx\t%.6f\t%s\n",
+                 job.rom.c_str(), input, job.frames,
+                 static_cast<unsigned long long>(job.state_hash),  // NOLINT
+                 static_cast<unsigned long long>(job.screen_hash),  // NOLINT
+                 job.seconds, job.status.c_str());
+  }
+  if (out != stdout) std::fclose(out);
+  std::fprintf(stderr, "%d jobs on %d threads in %.3f s; %d failed\n",
+               static_cast<int>(jobs.size()), num_threads, elapsed.count(),
+               failed);
+
+  return failed > 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,355 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/chip8.h"
+#include "src/lockstep.h"
+
+
+static const int kNumEngines = 6;
+static const Chip8::Dispatch kEngines[kNumEngines] = {
+  Chip8::kSwitchDispatch, Chip8::kTableDispatch, Chip8::kCachedDispatch,
+  Chip8::kFusedDispatch, Chip8::kJitDispatch, Chip8::kCompiledDispatch
+};
+static const char* kEngineNames[kNumEngines] = {
+  "switch", "table", "cached", "fused", "jit", "compiled"
+};
+
+// Run `frames` frames of a ROM headless at `ips` with the given dispatch
+// engine; returns instructions per second (meaningful only without idle
+// loop skipping, as skipped instructions count too) and sets
+// frames_per_second
+double InstructionsPerSecond(const std::string& path_to_rom,
+                             const Chip8::Dispatch dispatch,
+                             const bool skip_idle_loops,
+                             const int frames, const double ips,
+                             double* frames_per_second) {
+  Chip8 chip8;
+  chip8.tracing_ = Chip8::kNoTracing;
+  chip8.dispatch_ = dispatch;
+  chip8.skip_idle_loops_ = skip_idle_loops;
+  chip8.instructions_per_second_ = ips;
+  chip8.LoadProgram(path_to_rom);
+
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < frames; ++frame) chip8.EmulateCycle();
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+
+  *frames_per_second = frames/elapsed.count();
+  return static_cast<double>(chip8.instructions_)/elapsed.count();
+}
+
+// Keys held down, as a bitmask, until changed between frames
+class HeldKeys : public KeyboardInterface {
+ public:
+  explicit HeldKeys(const uint16_t keys) : keys_(keys) {}
+  uint16_t PressedKeys() { return keys_; }
+  void Hold(const uint16_t keys) { keys_ = keys; }
+
+ private:
+  uint16_t keys_;
+};
+
+// Keys held by lockstep instance `instance`: none, then each key in turn, so
+// that the instances diverge in ROMs that read the keyboard
+uint16_t LockstepKeys(const int instance) {
+  return instance ? 1 << ((instance - 1)%16) : 0;
+}
+
+// Run `frames` frames of a ROM at `ips` in one group of lockstep instances;
+// returns instructions per second over all instances
+double LockstepInstructionsPerSecond(const std::string& path_to_rom,
+                                     const int frames, const double ips) {
+  Chip8Lockstep lockstep(Chip8Lockstep::kLanes_);
+  lockstep.instructions_per_second_ = ips;
+  for (int i = 0; i < lockstep.num_instances_; ++i) {
+    lockstep.keys_[i] = LockstepKeys(i);
+  }
+  lockstep.LoadProgram(path_to_rom);
+
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < frames; ++frame) lockstep.EmulateCycle();
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+
+  return static_cast<double>(lockstep.instructions_)/elapsed.count();
+}
+
+// Keys held by every engine in frame `frame` of --validate: the lockstep
+// instances' keys in turn, 20 frames each, so that ROMs that read the
+// keyboard take their other paths too
+uint16_t ValidateKeys(const int frame) {
+  return LockstepKeys((frame/20)%17);
+}
+
+// Run every engine on a ROM in lockstep, holding the same keys, comparing
+// machine state against the switch engine, which runs every instruction,
+// after each frame; returns false on the first difference
+bool Validate(const std::string& path_to_rom, const int frames,
+              const double ips) {
+  std::vector<Chip8*> chip8s;
+  std::vector<HeldKeys*> keyboards;
+  for (int e = 0; e < kNumEngines; ++e) {
+    keyboards.push_back(new HeldKeys(0));
+    chip8s.push_back(new Chip8(new NullDisplay(), new NullSound(),
+                               keyboards[e]));
+    chip8s[e]->tracing_ = Chip8::kNoTracing;
+    chip8s[e]->dispatch_ = kEngines[e];
+    chip8s[e]->skip_idle_loops_ = e > 0;
+    chip8s[e]->instructions_per_second_ = ips;
+    chip8s[e]->LoadProgram(path_to_rom);
+  }
+
+  bool valid = true;
+  for (int frame = 0; frame < frames && valid; ++frame) {
+    for (int e = 0; e < kNumEngines; ++e) {
+      keyboards[e]->Hold(ValidateKeys(frame));
+      chip8s[e]->EmulateCycle();
+    }
+    const uint64_t expected = chip8s[0]->StateHash();
+    for (int e = 1; e < kNumEngines; ++e) {
+      if (chip8s[e]->StateHash() != expected) {
+        std::printf("%s: %s engine differs from switch at frame %d\n",
+                    path_to_rom.c_str(), kEngineNames[e], frame);
+        valid = false;
+      }
+    }
+  }
+
+  for (Chip8* chip8 : chip8s) delete chip8;
+  return valid;
+}
+
+// Run one group of lockstep instances, each holding different keys, next to
+// switch engines holding the same keys, comparing machine state after each
+// frame until an instance halts at an unknown instruction, which its switch
+// engine must have reached too; returns false on the first difference
+bool ValidateLockstep(const std::string& path_to_rom, const int frames,
+                      const double ips) {
+  Chip8Lockstep lockstep(Chip8Lockstep::kLanes_);
+  lockstep.instructions_per_second_ = ips;
+  lockstep.LoadProgram(path_to_rom);
+  std::vector<Chip8*> chip8s;
+  for (int i = 0; i < lockstep.num_instances_; ++i) {
+    lockstep.keys_[i] = LockstepKeys(i);
+    chip8s.push_back(new Chip8(new NullDisplay(), new NullSound(),
+                               new HeldKeys(LockstepKeys(i))));
+    chip8s[i]->tracing_ = Chip8::kNoTracing;
+    chip8s[i]->skip_idle_loops_ = false;
+    chip8s[i]->exit_on_unknown_ = false;
+    chip8s[i]->instructions_per_second_ = ips;
+    chip8s[i]->LoadProgram(path_to_rom);
+  }
+
+  Chip8 copy;
+  bool valid = true;
+  for (int frame = 0; frame < frames && valid; ++frame) {
+    lockstep.EmulateCycle();
+    for (int i = 0; i < lockstep.num_instances_ && valid; ++i) {
+      if (chip8s[i]->unknown_opcode_ >= 0) continue;  // Compared when halted
+      chip8s[i]->EmulateCycle();
+      if (lockstep.UnknownOpcode(i) >= 0
+       || chip8s[i]->unknown_opcode_ >= 0) {
+        if (lockstep.UnknownOpcode(i) != chip8s[i]->unknown_opcode_) {
+          std::printf("%s: lockstep instance %d halted differently from "
+                      "switch at frame %d\n", path_to_rom.c_str(), i, frame);
+          valid = false;
+        }
+        continue;
+      }
+      lockstep.CopyTo(i, &copy);
+      if (copy.StateHash() != chip8s[i]->StateHash()) {
+        std::printf("%s: lockstep instance %d differs from switch at frame "
+                    "%d\n", path_to_rom.c_str(), i, frame);
+        valid = false;
+      }
+    }
+  }
+
+  for (Chip8* chip8 : chip8s) delete chip8;
+  return valid;
+}
+
+static const char* kOpNames[Chip8::kNumOps] = {
+  "00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+  "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7", "8xyE",
+  "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07", "Fx0A",
+  "Fx15", "Fx18", "Fx1E", "Fx29", "Fx33", "Fx55", "Fx65", "????"
+};
+
+// Count straight-line sequences of two and three instructions (each at the
+// address after the one before, so candidates for fusing) executed by a ROM
+void Profile(const std::string& path_to_rom, const int frames,
+             std::map<std::string, int64_t>* pairs,
+             std::map<std::string, int64_t>* triples,
+             int64_t* instructions) {
+  Chip8 chip8;
+  chip8.tracing_ = Chip8::kNoTracing;
+  chip8.skip_idle_loops_ = false;
+  chip8.LoadProgram(path_to_rom);
+
+  int address[3] = {-1, -1, -1};
+  Chip8::Opcode op[3] = {Chip8::kOpUnknown, Chip8::kOpUnknown,
+                         Chip8::kOpUnknown};
+  for (int frame = 0; frame < frames; ++frame) {
+    const int budget = chip8.FrameBudget();
+    for (int i = 0; i < budget; ++i) {
+      const uint16_t opcode = chip8.OpcodeAt(chip8.pc_);
+      address[0] = address[1];
+      address[1] = address[2];
+      address[2] = chip8.pc_;
+      op[0] = op[1];
+      op[1] = op[2];
+      op[2] = Chip8::instruction_table_[opcode];
+      if (address[2] == address[1] + 2) {
+        ++(*pairs)[std::string(kOpNames[op[1]]) + "; " + kOpNames[op[2]]];
+        if (address[1] == address[0] + 2) {
+          ++(*triples)[std::string(kOpNames[op[0]]) + "; " + kOpNames[op[1]]
+                       + "; " + kOpNames[op[2]]];
+        }
+      }
+      chip8.ExecuteInstructions(1);
+    }
+    chip8.UpdateTimers();
+    *instructions += budget;
+  }
+}
+
+// Print the `count` most frequent sequences
+void PrintTop(const char* title, const std::map<std::string, int64_t>& counts,
+              const int64_t instructions, const int count) {
+  std::vector<std::pair<int64_t, std::string> > sorted;
+  for (const auto& entry : counts) {
+    sorted.push_back(std::make_pair(entry.second, entry.first));
+  }
+  std::sort(sorted.rbegin(), sorted.rend());
+  std::printf("%-24s %14s %10s\n", title, "count", "share");
+  for (int i = 0; i < count && i < static_cast<int>(sorted.size()); ++i) {
+    std::printf("%-24s %14lld %9.2f%%\n", sorted[i].second.c_str(),
+                static_cast<long long>(sorted[i].first),  // NOLINT
+                100.*sorted[i].first/instructions);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int frames = 100000;
+  double ips = Chip8::kDefaultInstructionsPerSecond_;
+  bool validate = false, profile = false;
+  std::vector<std::string> roms;
+  for (int i = 1; i < argc; ++i) {
+    if ( (!std::strcmp(argv[i], "-n") || !std::strcmp(argv[i], "--frames"))
+      && i + 1 < argc ) {
+      frames = std::atoi(argv[++i]);
+    } else if ( (!std::strcmp(argv[i], "-s")
+              || !std::strcmp(argv[i], "--ips")) && i + 1 < argc ) {
+      ips = std::atof(argv[++i]);
+    } else if (!std::strcmp(argv[i], "-v")
+            || !std::strcmp(argv[i], "--validate")) {
+      validate = true;
+    } else if (!std::strcmp(argv[i], "-p")
+            || !std::strcmp(argv[i], "--profile")) {
+      profile = true;
+    } else {
+      roms.push_back(argv[i]);
+    }
+  }
+
+  if (roms.empty() || frames <= 0 || !(ips > 0.)) {
+    std::printf(
+      "Usage: chip8_bench [ -n (--frames) FRAMES; default=100000; ]\n"
+      "                   [ -s (--ips) IPS; default=1080; ]\n"
+      "                   [ -v (--validate) ] [ -p (--profile) ]\n"
+      "                   ROM [ROM ...]\n"
+      "  Run each ROM headless for FRAMES frames at IPS with each dispatch\n"
+      "  engine and print instructions per second; with --validate, instead\n"
+      "  check every frame that each engine matches the switch engine; with\n"
+      "  --profile, instead print the most frequent straight-line pairs and\n"
+      "  triples of instructions over all ROMs.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (validate) {
+    int failures = 0;
+    for (const std::string& rom : roms) {
+      const bool engines_valid = Validate(rom, frames, ips);
+      const bool lockstep_valid = ValidateLockstep(rom, frames, ips);
+      failures += engines_valid && lockstep_valid ? 0 : 1;
+    }
+    std::printf("%d of %d ROMs validated over %d frames.\n",
+                static_cast<int>(roms.size()) - failures,
+                static_cast<int>(roms.size()), frames);
+    return failures ? EXIT_FAILURE : 0;
+  }
+
+  if (profile) {
+    std::map<std::string, int64_t> pairs, triples;
+    int64_t instructions = 0;
+    for (const std::string& rom : roms) {
+      Profile(rom, frames, &pairs, &triples, &instructions);
+    }
+    PrintTop("(pair)", pairs, instructions, 20);
+    std::printf("\n");
+    PrintTop("(triple)", triples, instructions, 20);
+    return 0;
+  }
+
+  // Engines run every instruction; the next column is the fused engine
+  // skipping idle loops, in emulated frames per second since the
+  // instructions it skips aren't run, and the last one group of lockstep
+  // instances. The idle column's speedup is against switch's frame rate
+  double total_ips[kNumEngines + 2] = {};
+  double switch_fps = 0.;
+
+  std::printf("%-24s", "ROM");
+  for (int e = 0; e < kNumEngines; ++e) {
+    std::printf(" %14s", (std::string(kEngineNames[e]) + " (IPS)").c_str());
+  }
+  std::printf(" %14s %14s\n", "+idle (FPS)", "lockstep (IPS)");
+  for (const std::string& rom : roms) {
+    const size_t slash = rom.find_last_of('/');
+    std::printf("%-24s",
+                rom.substr(slash == std::string::npos ? 0 : slash + 1).c_str());
+    for (int e = 0; e <= kNumEngines + 1; ++e) {
+      double fps = 0.;
+      double rate = e < kNumEngines
+        ? InstructionsPerSecond(rom, kEngines[e], false, frames, ips, &fps)
+        : e == kNumEngines
+        ? InstructionsPerSecond(rom, Chip8::kFusedDispatch, true, frames, ips,
+                                &fps)
+        : LockstepInstructionsPerSecond(rom, frames, ips);
+      if (e == 0) switch_fps += fps;
+      if (e == kNumEngines) rate = fps;
+      total_ips[e] += rate;
+      std::printf(" %14.4g", rate);
+    }
+    std::printf("\n");
+  }
+
+  std::printf("%-24s", "(mean)");
+  for (int e = 0; e <= kNumEngines + 1; ++e) {
+    std::printf(" %14.4g", total_ips[e]/roms.size());
+  }
+  std::printf("\n%-24s", "(speedup vs. switch)");
+  for (int e = 0; e <= kNumEngines + 1; ++e) {
+    std::printf(" %13.2fx",
+                total_ips[e]/(e == kNumEngines ? switch_fps : total_ips[0]));
+  }
+  std::printf("\n");
+
+  return 0;
+}
@@ -6,25 +6,33 @@
  */
 #include "src/chip8.h"
 
-#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 
-#include "src/display.h"
 
-
-// System architecture constants
-const int Chip8::kMemorySize_ = 0x1000;  // RAM
-const int Chip8::kRegistersSize_ = 16;  // Registers
-const int Chip8::kStackSize_ = 16;  // Interpreter return stack
+// System architecture constants (sizes in Chip8State)
+const int Chip8State::kMemorySize_;
+const int Chip8State::kRegistersSize_;
+const int Chip8State::kStackSize_;
+const int Chip8::kNumKeys_ = 16;  // Hex keypad
 
 // Graphics constants
-const int Chip8::kRows_ = 32;  // Rows of pixel buffer
+const int Chip8State::kRows_;
 const int Chip8::kCols_ = 64;  // Columns of pixel buffer
-const int Chip8::kPixelSize_ = 15;  // Size of pixel in display buffer
-const int Chip8::kChannels_ =  3;  // RGB
 const int Chip8::kFramesPerSecond_ = 60;  // Choose to make games playable
 const double Chip8::kSecondsPerFrame_
   = static_cast<double>(1.)/static_cast<double>(kFramesPerSecond_);
-clock_t Chip8::then_ = clock();
+const int Chip8::kMaxCatchUpFrames_ = 6;
+const int Chip8::kMaxRunAhead_ = 8;
+const double Chip8::kDefaultInstructionsPerSecond_ = 18*kFramesPerSecond_;
+const uint64_t Chip8::kDefaultSeed_ = 0x43484950;  // "CHIP"
+
+// Idle loops
+const int Chip8::kIdleCheckInterval_ = 6;
 
 // Font sprites
 const int Chip8::kFontSpritesAddress_ = 0x00;
@@ -49,72 +57,141 @@ const uint8_t Chip8::kFontSprites_[kBytesPerFontSprite_*kNumFontSprites_] = {
   0xF0, 0x80, 0xF0, 0x80, 0x80   // F
 };
 
+// Instruction dispatch table
+const int Chip8::kNumOpcodes_ = 0x10000;
+const Chip8::Instruction Chip8::kInstructions_[kNumOps] = {
+  &Chip8::Op00E0<NoTrace>, &Chip8::Op00EE<NoTrace>, &Chip8::Op1nnn<NoTrace>,
+  &Chip8::Op2nnn<NoTrace>, &Chip8::Op3xkk<NoTrace>, &Chip8::Op4xkk<NoTrace>,
+  &Chip8::Op5xy0<NoTrace>, &Chip8::Op6xkk<NoTrace>, &Chip8::Op7xkk<NoTrace>,
+  &Chip8::Op8xy0<NoTrace>, &Chip8::Op8xy1<NoTrace>, &Chip8::Op8xy2<NoTrace>,
+  &Chip8::Op8xy3<NoTrace>, &Chip8::Op8xy4<NoTrace>, &Chip8::Op8xy5<NoTrace>,
+  &Chip8::Op8xy6<NoTrace>, &Chip8::Op8xy7<NoTrace>, &Chip8::Op8xyE<NoTrace>,
+  &Chip8::Op9xy0<NoTrace>, &Chip8::OpAnnn<NoTrace>, &Chip8::OpBnnn<NoTrace>,
+  &Chip8::OpCxkk<NoTrace>, &Chip8::OpDxyn<NoTrace>, &Chip8::OpEx9E<NoTrace>,
+  &Chip8::OpExA1<NoTrace>, &Chip8::OpFx07<NoTrace>, &Chip8::OpFx0A<NoTrace>,
+  &Chip8::OpFx15<NoTrace>, &Chip8::OpFx18<NoTrace>, &Chip8::OpFx1E<NoTrace>,
+  &Chip8::OpFx29<NoTrace>, &Chip8::OpFx33<NoTrace>, &Chip8::OpFx55<NoTrace>,
+  &Chip8::OpFx65<NoTrace>, &Chip8::OpUnknown
+};
+Chip8::Opcode Chip8::instruction_table_[kNumOpcodes_];
+const bool Chip8::kInstructionTableBuilt_ = Chip8::BuildInstructionTable();
+
+// Superinstructions, longest first; together these sequences are about a
+// quarter of instructions executed over the ROMs in roms/
+const Chip8::Superinstruction Chip8::kSuperinstructions_[] = {
+  {{kOpFx07, kOp3xkk, kOp1nnn}, kOpFx07_3xkk_1nnn},  // Poll delay timer
+  {{kOp3xkk, kOp1nnn, kNumOps}, kOp3xkk_1nnn},  // Branch if not equal
+  {{kOp4xkk, kOp1nnn, kNumOps}, kOp4xkk_1nnn},  // Branch if equal
+  {{kOp6xkk, kOpEx9E, kNumOps}, kOp6xkk_Ex9E},  // Poll key
+  {{kOp6xkk, kOpExA1, kNumOps}, kOp6xkk_ExA1},  // Poll key
+  {{kOp6xkk, kOp6xkk, kNumOps}, kOp6xkk_6xkk},
+  {{kOp6xkk, kOp8xy5, kNumOps}, kOp6xkk_8xy5},
+  {{kOp7xkk, kOp3xkk, kNumOps}, kOp7xkk_3xkk},  // Count down loop
+  {{kOp7xkk, kOp6xkk, kNumOps}, kOp7xkk_6xkk},
+  {{kOp8xy5, kOp4xkk, kNumOps}, kOp8xy5_4xkk},  // Compare
+  {{kOpAnnn, kOpDxyn, kNumOps}, kOpAnnn_Dxyn},  // Draw sprite
+  {{kOpAnnn, kOpFx1E, kNumOps}, kOpAnnn_Fx1E},  // Index into table
+  {{kOpFx1E, kOpDxyn, kNumOps}, kOpFx1E_Dxyn},  // Draw sprite from table
+  {{kOpFx1E, kOpFx65, kNumOps}, kOpFx1E_Fx65}   // Load from table
+};
+const int Chip8::kNumSuperinstructions_
+  = sizeof(kSuperinstructions_)/sizeof(kSuperinstructions_[0]);
+const int Chip8::kMaxFusedBytes_ = 6;
+
 // Program
 const int Chip8::kProgramAddress_ = 0x0200;
 const int Chip8::kMaxProgramSize_ = kMemorySize_ - kProgramAddress_;
 
-Chip8::Chip8() {
-  // System architecture
-  memory_ = new uint8_t[kMemorySize_]();
-  v_ = new uint8_t[kRegistersSize_]();
-  index_ = 0;
+Chip8::Chip8()
+  : Chip8(new NullDisplay(), new NullSound(), new NullKeyboard()) {
+}
+
+Chip8::Chip8(DisplayInterface* display,
+             SoundInterface* sound,
+             KeyboardInterface* keyboard)
+  : Chip8State() {
+  // System architecture; the state starts zeroed
+  decode_cache_ = new DecodedInstruction[kMemorySize_];
+  jit_ = NULL;
+  compiled_ = NULL;
+  compiled_stale_ = false;
+  InvalidateDecodeCache();
+  exit_on_unknown_ = true;
+  unknown_opcode_ = -1;
   pc_ = 0x200;
-  sp_ = 0;
-  stack_ = new uint16_t[kStackSize_]();
-  delay_timer_ = 0;
-  sound_timer_ = 0;
+  program_size_ = 0;
 
   // System configuration
-  speed_  = 18;
+  instructions_per_second_ = kDefaultInstructionsPerSecond_;
+  budget_carry_ = 0.;
+  instructions_ = 0;
+  paced_ = true;
   wrap_around_y_ = false;
-  foreground_red_pixel_value_
-    = foreground_green_pixel_value_
-    = foreground_blue_pixel_value_
-    = 255;
-  background_red_pixel_value_
-    = background_green_pixel_value_
-    = background_blue_pixel_value_
-    = 0;
+  random_.Seed(kDefaultSeed_);
+  skip_idle_loops_ = true;
+  dispatch_ = kSwitchDispatch;
+  tracing_ = DEBUG ? kStepTracing : kNoTracing;
 
   // Load font sprites into memory
   LoadFontSprites();
 
-  // Keyboard
-  keyboard_ = new Keyboard();
+  // Keyboard; Chip8 takes ownership of the frontends
+  keyboard_ = keyboard;
 
   // Sound
-  sound_ = new Sound();
+  sound_ = sound;
   sound_->Start(0);  // Warmup
   sound_->Stop();
 
   // Graphics
-  pixel_buffer_ = new uint8_t*[kRows_]();
-  for (int i = 0; i < kRows_; ++i) pixel_buffer_[i] = new uint8_t[kCols_]();
-  display_buffer_ = new uint8_t[(kRows_*kPixelSize_)
-                                *(kCols_*kPixelSize_)*kChannels_]();
-  display_ = new Display(kRows_*kPixelSize_,
-                         kCols_*kPixelSize_,
-                         display_buffer_,
-                         keyboard_);
+  dirty_begin_ = 0;
+  dirty_end_ = kRows_;
+  display_ = display;
+
+  // Rewind
+  rewind_ = NULL;
+
+  // Run-ahead
+  run_ahead_ = 0;
+  run_ahead_timing_.frames = 0;
+  run_ahead_timing_.total = run_ahead_timing_.max = 0.;
+
+  // Pacing
+  next_frame_ = frame_begin_ = std::chrono::steady_clock::now();
+  input_time_ = std::chrono::steady_clock::time_point();
+  frame_timing_.frames = frame_timing_.caught_up = frame_timing_.dropped = 0;
+  frame_timing_.late_total = frame_timing_.late_squares
+    = frame_timing_.late_max = 0.;
 }
 
 void Chip8::Run(const std::string& path_to_rom) {
   // Load program into memory
   LoadProgram(path_to_rom);
+  state_path_ = path_to_rom + ".state";
 
+  // Emulate on a thread of its own, which hands each frame to the display;
+  // this thread, which created the display, presents the frames and polls
+  // input (the keyboard is read through atomics) until the window closes
+  std::atomic<bool> running(true);
+  next_frame_ = std::chrono::steady_clock::now();
+  std::thread emulation([this, &running]() {
+    while (running.load(std::memory_order_relaxed)) {
+      Step();  // Step program, update display buffer
+    }
+  });
   while (!display_->ShouldClose()) {
-    Step();  // Step program, update display buffer
+    display_->Refresh();
   }
+  running.store(false, std::memory_order_relaxed);
+  emulation.join();
 }
 
 Chip8::~Chip8() {
   // Cleanup
   // Memory
-  delete[] memory_;
-
-  // Register
-  delete[] v_;
-  delete[] stack_;
+  delete[] decode_cache_;
+  delete jit_;
+  delete rewind_;
 
   // Keyboard
   delete keyboard_;
@@ -123,45 +200,121 @@ Chip8::~Chip8() {
   delete sound_;
 
   // Display
-  for (int i = 0; i < kRows_; ++i) delete[] pixel_buffer_[i];
-  delete[] pixel_buffer_;
-  delete[] display_buffer_;
   delete display_;
 }
 
 inline void Chip8::UnknownInstruction(const uint16_t opcode) {
+  if (!exit_on_unknown_) {
+    if (unknown_opcode_ < 0) unknown_opcode_ = opcode;
+    return;
+  }
   std::fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
   std::exit(EXIT_FAILURE);
 }
 
-void Chip8::InterpretInstruction(const uint16_t opcode) {
-  if (DEBUG) {
+Chip8::Opcode Chip8::DecodeInstruction(const uint16_t opcode) {
+  switch (opcode & 0xF000) {
+    case 0x0000: {
+      switch (opcode & 0x00FF) {
+        case 0x00E0: return kOp00E0;
+        case 0x00EE: return kOp00EE;
+        default: return kOpUnknown;
+      }
+    }
+    case 0x1000: return kOp1nnn;
+    case 0x2000: return kOp2nnn;
+    case 0x3000: return kOp3xkk;
+    case 0x4000: return kOp4xkk;
+    case 0x5000: return kOp5xy0;
+    case 0x6000: return kOp6xkk;
+    case 0x7000: return kOp7xkk;
+    case 0x8000: {
+      switch (opcode & 0x000F) {
+        case 0x0000: return kOp8xy0;
+        case 0x0001: return kOp8xy1;
+        case 0x0002: return kOp8xy2;
+        case 0x0003: return kOp8xy3;
+        case 0x0004: return kOp8xy4;
+        case 0x0005: return kOp8xy5;
+        case 0x0006: return kOp8xy6;
+        case 0x0007: return kOp8xy7;
+        case 0x000E: return kOp8xyE;
+        default: return kOpUnknown;
+      }
+    }
+    case 0x9000: return kOp9xy0;
+    case 0xA000: return kOpAnnn;
+    case 0xB000: return kOpBnnn;
+    case 0xC000: return kOpCxkk;
+    case 0xD000: return kOpDxyn;
+    case 0xE000: {
+      switch (opcode & 0x00FF) {
+        case 0x009E: return kOpEx9E;
+        case 0x00A1: return kOpExA1;
+        default: return kOpUnknown;
+      }
+    }
+    case 0xF000: {
+      switch (opcode & 0x00FF) {
+        case 0x0007: return kOpFx07;
+        case 0x000A: return kOpFx0A;
+        case 0x0015: return kOpFx15;
+        case 0x0018: return kOpFx18;
+        case 0x001E: return kOpFx1E;
+        case 0x0029: return kOpFx29;
+        case 0x0033: return kOpFx33;
+        case 0x0055: return kOpFx55;
+        case 0x0065: return kOpFx65;
+        default: return kOpUnknown;
+      }
+    }
+    default: return kOpUnknown;
+  }
+}
+
+bool Chip8::BuildInstructionTable() {
+  for (int opcode = 0; opcode < kNumOpcodes_; ++opcode) {
+    instruction_table_[opcode] = DecodeInstruction(opcode);
+  }
+  return true;
+}
+
+template <typename Trace>
+inline void Chip8::DebugState(const uint16_t opcode) {
+  if (Trace::kStep) {
     printf("[Press ENTER key to step]\n");
     getchar();
   }
+  if (Trace::kEnabled) {
+
+    // Extract values from (16-bit) opcode
+    const uint8_t  x   = (opcode >> 8) & 0x000F;  //  4 lower bits of upper byte
+    const uint8_t  y   = (opcode >> 4) & 0x000F;  //  4 upper bits of lower byte
+    const uint8_t  n   = opcode        & 0x000F;  //  4 lowest bits
+    const uint8_t  kk  = opcode        & 0x00FF;  //  8 lowest bits
+    const uint16_t nnn = opcode        & 0x0FFF;  // 12 lowest bits
+
+    DebugMessage<Trace>("      CURRENT STATE      \n"
+                 "    -----------------    \n"
+                 "    pc      |  0x%04X    \n"
+                 "    opcode  |  0x%04X    \n"
+                 "    sp      |  0x  %02X  \n"
+                 "    index   |  0x%04X    \n"
+                 "    x       |  0x %01X   \n"
+                 "    y       |  0x  %01X  \n"
+                 "    n       |  0x   %01X \n"
+                 "    kk      |  0x  %02X  \n"
+                 "    nnn     |  0x %03X   \n"
+                 "    Vx      |  0x  %02X  \n"
+                 "    Vy      |  0x  %02X  \n"
+                 "                         \n",
+                 pc_, opcode, sp_, index_, x, y, n, kk, nnn, v_[x], v_[y]);
+  }
+}
 
-  // Extract values from (16-bit) opcode
-  const uint8_t  x   = (opcode >> 8) & 0x000F;  //  4 lower bits of upper byte
-  const uint8_t  y   = (opcode >> 4) & 0x000F;  //  4 upper bits of lower byte
-  const uint8_t  n   = opcode        & 0x000F;  //  4 lowest bits
-  const uint8_t  kk  = opcode        & 0x00FF;  //  8 lowest bits
-  const uint16_t nnn = opcode        & 0x0FFF;  // 12 lowest bits
-
-  DebugMessage("      CURRENT STATE      \n"
-               "    -----------------    \n"
-               "    pc      |  0x%04X    \n"
-               "    opcode  |  0x%04X    \n"
-               "    sp      |  0x  %02X  \n"
-               "    index   |  0x%04X    \n"
-               "    x       |  0x %01X   \n"
-               "    y       |  0x  %01X  \n"
-               "    n       |  0x   %01X \n"
-               "    kk      |  0x  %02X  \n"
-               "    nnn     |  0x %03X   \n"
-               "    Vx      |  0x  %02X  \n"
-               "    Vy      |  0x  %02X  \n"
-               "                         \n",
-               pc_, opcode, sp_, index_, x, y, n, kk, nnn, v_[x], v_[y]);
+template <typename Trace>
+void Chip8::InterpretInstruction(const uint16_t opcode) {
+  DebugState<Trace>(opcode);
 
   // opcode 0x#### is 4*4 bits = 2 bytes long;
   // increment program counter by one opcode
@@ -169,470 +322,770 @@ void Chip8::InterpretInstruction(const uint16_t opcode) {
 
   switch (opcode & 0xF000) {
     case 0x0000: {  // 0x0kk
-      switch (kk) {
-        case 0x00E0: {  // 00E0: CLR
-          DebugMessage(
-            "[0x00E0: CLR]\n"
-            "    Clear screen.\n");
-          ClearPixelBuffer();
-          break;
-        }
-        case 0x00EE: {  // 00EE: RET
-          DebugMessage(
-            "[0x00EE: RET]\n"
-            "    Return: set sp -= 1 = 0x%02X; pc = stack[sp] = 0x%04X.\n",
-            sp_ - 1,
-            stack_[sp_ - 1]);
-          pc_ = stack_[--sp_];
-          break;
-        }
+      switch (opcode & 0x00FF) {
+        case 0x00E0: Op00E0<Trace>(opcode); break;
+        case 0x00EE: Op00EE<Trace>(opcode); break;
         default: UnknownInstruction(opcode);
       }
       break;
     }
-    case 0x1000: {  // 1nnn: JP addr
-      DebugMessage(
-        "[0x1nnn: JP addr]\n"
-        "    Jump to address nnn: set pc = 0x%04X.\n",
-        nnn);
-      pc_ = nnn;
-      break;
-    }
-    case 0x2000: {  // 2nnn: CALL addr
-      DebugMessage(
-        "[0x2nnn: CALL addr]\n"
-        "    Call address nnn: stack[sp] = pc = 0x%04X;\n"
-        "    sp += 1 = 0x%02X; pc = 0x%04X.\n",
-        pc_, sp_ + 1,
-        nnn);
-      stack_[sp_++] = pc_;
-      pc_ = nnn;
-      break;
-    }
-    case 0x3000: {  // 3xkk: SE Vx, byte
-      DebugMessage(
-        "[0x3xkk: SE Vx, byte]\n"
-        "    Skip next instruction if Vx == kk: set pc += %d\n"
-        "    because 0x%02X %c= 0x%02X.\n",
-        (v_[x] == kk) ? 2 : 0,
-        v_[x], (v_[x] == kk) ? '=' : '!', kk);
-      pc_ += (v_[x] == kk) ? 2 : 0;
-      break;
-    }
-    case 0x4000: {  // 4xkk: SNE Vx, byte
-      DebugMessage(
-        "[0x4xkk: SNE Vx, byte]\n"
-        "    Skip next instruction if Vx != kk: set pc += %d\n"
-        "    because 0x%02X %c= 0x%02X.\n",
-        (v_[x] != kk) ? 2 : 0,
-        v_[x], (v_[x] != kk) ? '!' : '=', kk);
-      pc_ += (v_[x] != kk) ? 2 : 0;
-      break;
-    }
-    case 0x5000: {  // 5xy0: SE Vx, Vy
-      DebugMessage(
-        "[0x5xy0: SE Vx, Vy]\n"
-        "    Skip next instruction if Vx == Vy: set pc += %d\n"
-        "    because 0x%02X %c= 0x%02X.\n",
-        (v_[x] == v_[y]) ? 2 : 0,
-        v_[x], (v_[x] == v_[y]) ? '=' : '!', v_[y]);
-      pc_ += (v_[x] == v_[y]) ? 2 : 0;
-      break;
-    }
-    case 0x6000: {  // 6xkk: LD Vx, byte
-      DebugMessage(
-        "[0x6xkk: LD Vx, byte]\n"
-        "    Load byte kk into register Vx: set Vx = 0x%02X.\n", kk);
-      v_[x] = kk;
-      break;
-    }
-    case 0x7000: {  // 7xkk: ADD Vx, byte
-      DebugMessage(
-        "[0x7xkk: ADD Vx, byte]\n"
-        "    Load Vx + kk into register Vx: set Vx += 0x%02X = 0x%02X.\n",
-        kk, v_[x] + kk);
-      v_[x] += kk;
-      break;
-    }
+    case 0x1000: Op1nnn<Trace>(opcode); break;
+    case 0x2000: Op2nnn<Trace>(opcode); break;
+    case 0x3000: Op3xkk<Trace>(opcode); break;
+    case 0x4000: Op4xkk<Trace>(opcode); break;
+    case 0x5000: Op5xy0<Trace>(opcode); break;
+    case 0x6000: Op6xkk<Trace>(opcode); break;
+    case 0x7000: Op7xkk<Trace>(opcode); break;
     case 0x8000: {  // 8xyn
-      switch (n) {
-        case 0x0000: {  // 8xy0: LD Vx, Vy
-          DebugMessage(
-            "[0x8xy0: LD Vx, Vy]\n"
-            "    Load Vy into register Vx: set Vx = 0x%02X.\n",
-            v_[y]);
-          v_[x] = v_[y];
-          break;
-        }
-        case 0x0001: {  // 8xy1: OR Vx, Vy
-          DebugMessage(
-            "[0x8xy1: OR Vx, Vy]\n"
-            "    Load Vx | Vy into register Vx:\n"
-            "    set Vx = 0x%02X | 0x%02X = 0x%02X.\n",
-            v_[x], v_[y], v_[x] | v_[y]);
-          v_[x] |= v_[y];
-          break;
-        }
-        case 0x0002: {  //  8xy2: AND Vx, Vy
-          DebugMessage(
-            "[0x8xy2: AND Vx, Vy]\n"
-            "    Load Vx & Vy into register Vx:\n"
-            "    set Vx = 0x%02X & 0x%02X = 0x%02X.\n",
-            v_[x], v_[y], v_[x] & v_[y]);
-          v_[x] &= v_[y];
-          break;
-        }
-        case 0x0003: {  // 8xy3: XOR Vx, Vy
-          DebugMessage(
-            "[0x8xy3: XOR Vx, Vy]\n"
-            "    Load Vx ^ Vy into register Vx:\n"
-            "    set Vx = 0x%02X ^ 0x%02X = 0x%02X.\n",
-            v_[x], v_[y], v_[x] ^ v_[y]);
-          v_[x] ^= v_[y];
-          break;
-        }
-        case 0x0004: {  // 8xy4: ADD Vx, Vy
-          const int carry = ((static_cast<int>(v_[x]) + static_cast<int>(v_[y])) > 255) ? 1 : 0;
-          const int res = v_[x] + v_[y];
-          DebugMessage(
-            "[0x8xy4: ADD Vx, Vy]\n"
-            "    Store Vx + Vy into register Vx: store carry VF = %d\n"
-            "    and set Vx = 0x%02X + 0x%02X = 0x%02X.\n",
-            carry,
-            v_[x], v_[y], res);
-          v_[x] = res;
-          v_[0xF] = carry;
-          break;
-        }
-        case 0x0005: {  // 8xy5: SUB Vx, Vy
-          const int no_borrow = (v_[x] >= v_[y]) ? 1 : 0;
-          const int res = v_[x] - v_[y];
-          DebugMessage(
-            "[0x8xy5: SUB Vx, Vy]\n"
-            "    Store Vx - Vy into register Vx: store carry VF = %d\n"
-            "    because Vx %s Vy and set Vx = 0x%02X - 0x%02X = 0x%02X.\n",
-            no_borrow, no_borrow ?  ">=" : "<",
-            v_[x], v_[y], res);
-          v_[x] = res;
-          v_[0xF] = no_borrow;
-          break;
-        }
-        case 0x0006: {  // 8xy6: SHR Vx {, Vy}
-          const int lsb = v_[x] & 0x01;
-          const int res = v_[x] >> 1;
-          DebugMessage(
-            "[0x8xy6: SHR Vx{, Vy}]\n"
-            "    Shift right Vx one bit: store least significant bit VF = %d\n"
-            "    and set Vx = (0x%02X >> 1) = 0x%02X.\n",
-            lsb,
-            v_[x], res);
-          v_[x] = res;
-          v_[0xF] = lsb;
-          break;
-        }
-        case 0x0007: {  // 8xy7: SUBN Vx, Vy
-          const int no_borrow = (v_[y] >= v_[x]) ?  1 : 0;
-          const int res = v_[y] - v_[x];
-          DebugMessage(
-            "[0x8xy7: SUBN Vx, Vy]\n"
-            "    Store Vy - Vx into register Vx: store carry VF = %d\n"
-            "    because Vy %s Vx and set Vx = 0x%02X - 0x%02X = 0x%02X.\n",
-            no_borrow, no_borrow ? ">=" : "<",
-            v_[y], v_[x], res);
-          v_[x] = res;
-          v_[0xF] = no_borrow;
-          break;
-        }
-        case 0x000E: {  // 8xyE: SHL Vx{, Vy}
-          const int msb = v_[x] & 0x80 ? 1 : 0;
-          const int res = v_[x] << 1;
-          DebugMessage(
-            "[0x8xyE: SHL Vx{, Vy}]\n"
-            "    Shift left Vx one bit: store most significant bit VF = %d\n"
-            "    and set Vx = (0x%02X << 1) = 0x%02X.\n",
-            msb,
-            v_[x], res);
-          v_[x] = res;
-          v_[0xF] = msb;
-          break;
-        }
+      switch (opcode & 0x000F) {
+        case 0x0000: Op8xy0<Trace>(opcode); break;
+        case 0x0001: Op8xy1<Trace>(opcode); break;
+        case 0x0002: Op8xy2<Trace>(opcode); break;
+        case 0x0003: Op8xy3<Trace>(opcode); break;
+        case 0x0004: Op8xy4<Trace>(opcode); break;
+        case 0x0005: Op8xy5<Trace>(opcode); break;
+        case 0x0006: Op8xy6<Trace>(opcode); break;
+        case 0x0007: Op8xy7<Trace>(opcode); break;
+        case 0x000E: Op8xyE<Trace>(opcode); break;
         default: UnknownInstruction(opcode);
       }
       break;
     }
-    case 0x9000: {  // 9xy0: SNE Vx, Vy
-      DebugMessage(
-        "[0x9xy0: SNE Vx, Vy]\n"
-        "    Skip next instruction if Vx != Vy: set pc += %d\n"
-        "    because 0x%02X %c= 0x%02X.\n",
-        (v_[x] != v_[y]) ? 2 : 0,
-        v_[x], (v_[x] != v_[y]) ? '!' : '=', v_[y]);
-      pc_ += (v_[x] != v_[y]) ? 2 : 0;
-      break;
-    }
-    case 0xA000: {  // Annn: LD I, addr
-      DebugMessage(
-        "[0xAnnn: LD I, addr]\n"
-        "    Load address nnn into register I: set index = 0x%03X.\n",
-        nnn);
-      index_ = nnn;
-      break;
-    }
-    case 0xB000: {  // Bnnn: JP V0, addr
-      DebugMessage(
-        "[0xBnnn: JP V0, addr]\n"
-        "    Jump to address nnn + V0: set pc = 0x%03X + 0x%02X = 0x%04X.\n",
-        nnn, v_[0], nnn + v_[0]);
-      pc_ = nnn + v_[0];
-      break;
-    }
-    case 0xC000: {  // Cxkk: RND Vx, byte
-      unsigned int seed = time(NULL);
-      uint8_t res = (rand_r(&seed) % 0x00FF) & kk;
-      DebugMessage(
-        "[0xCxkk: RND Vx, byte]\n"
-        "    Load random byte & kk into register Vx:\n"
-        "    set Vx = (rand_r(&seed) % 0x00FF) & 0x%02X = 0x%02X.\n",
-        kk, res);
-      v_[x] = res;
-      break;
-    }
-    case 0xD000: {  // Dxyn: DRW Vx, Vy, nibble
-      uint8_t collision = DrawSpriteToPixelBuffer(v_[y], v_[x], n) ? 1 : 0;
-      DebugMessage(
-        "[0xDxyn: DRW Vx, Vy, nibble]\n"
-        "    Draw %d-byte sprite starting at memory location I = 0x%03X\n"
-        "    at (Vx, Vy) = (0x%02X, 0x%02X); set VF = %d (collision).\n",
-        n,
-        index_,
-        v_[x], v_[y], collision);
-      v_[0xF] = collision;
-      break;
-    }
+    case 0x9000: Op9xy0<Trace>(opcode); break;
+    case 0xA000: OpAnnn<Trace>(opcode); break;
+    case 0xB000: OpBnnn<Trace>(opcode); break;
+    case 0xC000: OpCxkk<Trace>(opcode); break;
+    case 0xD000: OpDxyn<Trace>(opcode); break;
     case 0xE000: {  // Exkk
-      switch (kk) {
-        case 0x009E: {  // Ex9E: SKP Vx
-          DebugMessage(
-            "[0xEx9E: SKP Vx]\n"
-            "    Skip next instruction if key with value Vx is pressed:\n"
-            "    set pc += %d because Vx = 0x%02X\n"
-            "    and KeyIsPressed(0x%02X) == %s.\n",
-            keyboard_->KeyIsPressed(v_[x]) ? 2 : 0, v_[x],
-            v_[x], keyboard_->KeyIsPressed(v_[x]) ? "true" : "false");
-          if (keyboard_->KeyIsPressed(v_[x])) pc_ += 2;
-          break;
-        }
-        case 0x00A1: {  // ExA1: SKNP Vx
-          DebugMessage(
-            "[0xExA1: SKNP Vx]\n"
-            "    Skip next instruction if key with value Vx is not pressed:\n"
-            "    set pc += %d because Vx = 0x%02X\n"
-            "    and KeyIsPressed(0x%02X) == %s.\n",
-            !keyboard_->KeyIsPressed(v_[x]) ? 2 : 0, v_[x],
-            v_[x], keyboard_->KeyIsPressed(v_[x]) ? "true" : "false");
-          if (!keyboard_->KeyIsPressed(v_[x])) pc_ += 2;
-          break;
-        }
+      switch (opcode & 0x00FF) {
+        case 0x009E: OpEx9E<Trace>(opcode); break;
+        case 0x00A1: OpExA1<Trace>(opcode); break;
         default: UnknownInstruction(opcode);
       }
       break;
     }
-    case 0xF000: {
-      switch (kk) {  // Fxkk
-        case 0x0007: {  // Fx07: LD Vx, DT
-          DebugMessage(
-            "[0xFx07: LD Vx, DT]\n"
-            "    Load delay timer into register Vx:\n"
-            "    set Vx = delay_timer = 0x%02X.\n",
-            delay_timer_);
-          v_[x] = delay_timer_;
-          break;
-        }
-        case 0x000A: {  // Fx0A: LD Vx, K
-          DebugMessage(
-            "[0xFx0A: LD Vx, K]\n"
-            "    Wait for any keypress and store into register Vx:\n");
-          while (true) {
-            DrawPixelsToDisplayBuffer();
-            display_->Paint();  // So we always see the updated screen while
-                                // waiting for input; Paint will poll events
-
-            if (display_->ShouldClose()) goto get_out_of_here;
-
-            for (std::pair<uint8_t, bool> kp : keyboard_->key_pressed_flag_) {
-              if (kp.second == true) {
-                v_[x] = kp.first;
-                DebugMessage("    stored 0x%02X into register Vx.\n", kp.first);
-                goto get_out_of_here;
-              }
-            }
-          }
-          get_out_of_here:
-          break;
-        }
-        case 0x0015: {  // Fx15: LD DT, Vx
-          DebugMessage(
-            "[0xFx15: LD DT, Vx]\n"
-            "    Set delay timer to value stored in register Vx:\n"
-            "    set delay_timer = Vx = 0x%02X.\n",
-            v_[x]);
-          delay_timer_ = v_[x];
-          break;
-        }
-        case 0x0018: {  // Fx18: LD ST, Vx
-          DebugMessage(
-            "[0xFx18: LD ST, Vx]\n"
-            "    Set sound timer to value stored in register Vx:\n"
-            "    set sound_timer = Vx = 0x%02X.\n",
-            v_[x]);
-          sound_timer_ = v_[x];
-          break;
-        }
-        case 0x001E: {  // Fx1E: ADD I, Vx
-          DebugMessage(
-            "[0xFx1E: ADD I, Vx]\n"
-            "    Add value store in Vx to register I:\n"
-            "    set index += 0x%02X = 0x%03X.\n",
-            v_[x], index_ + v_[x]);
-          index_ += v_[x];
-          break;
-        }
-        case 0x0029: {  // Fx29: LD F, Vx
-          DebugMessage(
-            "[0xFx29: LD F, Vx]\n"
-            "    Set register I to location of sprite for digit Vx:\n"
-            "    set index = 0x%02X*0x%02X = 0x%03X.\n",
-            kBytesPerFontSprite_, v_[x], kBytesPerFontSprite_*v_[x]);
-          index_ = kBytesPerFontSprite_*v_[x];
-          break;
-        }
-        case 0x0033: {  // Fx33: LD B, Vx
-          DebugMessage(
-            "[0xFx33: LD B, Vx]\n"
-            "    Load Binary Coded Decimal representation of Vx in memory:\n"
-            "    memory[0x%03X] = 0x%02X\n"
-            "    memory[0x%03X] = 0x%02X\n"
-            "    memory[0x%03X] = 0x%02X.\n",
-            index_    , (v_[x]/100)%10,
-            index_ + 1, (v_[x]/ 10)%10,
-            index_ + 2, (v_[x]/  1)%10);
-          memory_[index_    ] = (v_[x]/100)%10;  // Vx hundreds digit store at I
-          memory_[index_ + 1] = (v_[x]/ 10)%10;  // Vx tens digit store at I+1
-          memory_[index_ + 2] = (v_[x]/  1)%10;  // Vx ones digit store at I+2
-          break;
-        }
-        case 0x0055: {  // Fx55: LD [I], Vx
-          DebugMessage(
-            "[0xFx55: LD [I], Vx]\n"
-            "    Store registers V0 through Vx in memory\n"
-            "    starting at I = 0x%03X:",
-            index_);
-          for (int i = 0; i <= x; ++i) {
-            DebugMessage(
-              "\n    memory[0x%03X] = V%d = 0x%02X",
-              index_ + i, i, v_[i]);
-          }
-          DebugMessage(".\n");
-
-          for (int i = 0; i <= x; ++i) memory_[index_ + i] = v_[i];
-          break;
-        }
-        case 0x0065: {  // Fx65: LD Vx, [I]
-          DebugMessage(
-            "[0xFx65: LD Vx, [I] ]\n"
-            "    Load from memory into registers V0 through Vx\n"
-            "    starting at I = 0x%03X:",
-            index_);
-          for (int i = 0; i <= x; ++i) {
-            DebugMessage(
-              "\n    V%d = memory[0x%03X] = 0x%02X",
-              i, index_ + i, memory_[index_ + i]);
-          }
-          DebugMessage(".\n");
-
-          for (int i = 0; i <= x; ++i) v_[i] = memory_[index_ + i];
-          break;
-        }
+    case 0xF000: {  // Fxkk
+      switch (opcode & 0x00FF) {
+        case 0x0007: OpFx07<Trace>(opcode); break;
+        case 0x000A: OpFx0A<Trace>(opcode); break;
+        case 0x0015: OpFx15<Trace>(opcode); break;
+        case 0x0018: OpFx18<Trace>(opcode); break;
+        case 0x001E: OpFx1E<Trace>(opcode); break;
+        case 0x0029: OpFx29<Trace>(opcode); break;
+        case 0x0033: OpFx33<Trace>(opcode); break;
+        case 0x0055: OpFx55<Trace>(opcode); break;
+        case 0x0065: OpFx65<Trace>(opcode); break;
         default: UnknownInstruction(opcode);
       }
       break;
     }
     default: UnknownInstruction(opcode);
   }
-  DebugScreen();
+  DebugScreen<Trace>();
 }
 
-bool Chip8::TogglePixel(int i, int j) {
-  // Chip-8 specification does not say whether to wrap around in y,
-  // some ROMs are written assuming yes and others no
-  if (!wrap_around_y_) {
-    if (i < 0 || i >= kRows_) return false;
+template <typename Trace>
+void Chip8::InterpretInstructions(const int count) {
+  for (int i = 0; i < count; ++i) {
+    InterpretInstruction<Trace>(OpcodeAt(pc_));
   }
+}
 
-  // Remember: C's % is division remainder, not modulo
-  i = (kRows_ + (i%kRows_))%kRows_;
-  j = (kCols_ + (j%kCols_))%kCols_;
+void Chip8::DispatchInstruction(const uint16_t opcode) {
+  pc_ += 2;
 
-  pixel_buffer_[i][j] ^= 1;
-  return pixel_buffer_[i][j] != 1;
+  // One table lookup instead of the nested switch on opcode fields
+  (this->*kInstructions_[instruction_table_[opcode]])(opcode);
 }
 
-void Chip8::ClearPixelBuffer() {
-  for (int i = 0; i < kRows_; ++i) {
-    for (int j = 0; j < kCols_; ++j) {
-      pixel_buffer_[i][j] = 0;
+void Chip8::InvalidateDecodeCache() {
+  for (int i = 0; i < kMemorySize_; ++i) decode_cache_[i].op = kOpUndecoded;
+  if (jit_) jit_->Flush();
+}
+
+inline void Chip8::InvalidateDecodeCache(const int address, const int count) {
+  // A write at address also changes the instruction that starts one byte
+  // earlier, and any superinstruction that runs over it
+  for (int i = address - (kMaxFusedBytes_ - 1); i < address + count; ++i) {
+    if (0 <= i && i < kMemorySize_) decode_cache_[i].op = kOpUndecoded;
+  }
+  if (jit_) jit_->Invalidate(address, count);
+  if (compiled_ && !compiled_stale_) {
+    for (int i = address; i < address + count; ++i) {
+      compiled_stale_ |= compiled_->IsCode(i);
     }
   }
 }
 
-void Chip8::ClearDisplayBuffer() {
-  for (int i = 0;
-       i < (kRows_*kPixelSize_)*(kCols_*kPixelSize_);
-       ++i
-  ) {
-    display_buffer_[i*kChannels_ + 0] = background_red_pixel_value_;
-    display_buffer_[i*kChannels_ + 1] = background_green_pixel_value_;
-    display_buffer_[i*kChannels_ + 2] = background_blue_pixel_value_;
+void Chip8::JitInstructions(const int count) {
+  if (!jit_) jit_ = new Jit(kMemorySize_);
+
+  int remaining = count;
+  while (remaining > 0) {
+    // A block stops at what's left of the budget, so instruction counts
+    // (and so timers and input) match the interpreter; instructions the JIT
+    // leaves to the interpreter go to the cached dispatcher one at a time
+    const Jit::Block& block = jit_->Lookup(pc_, memory_);
+    if (block.length > 0) {
+      const uint32_t exit
+        = block.code(v_, &index_, &delay_timer_, &sound_timer_, remaining);
+      pc_ = exit & 0xFFFF;
+      remaining -= exit >> 16;
+    } else {
+      DispatchInstructions<true>(1);
+      --remaining;
+    }
   }
 }
 
-void Chip8::DrawPixelToDisplayBuffer(const int& i, const int& j) {
-  // Draw pixel at (i, j) in the pixel buffer to the display buffer
-  int m0 = i*kPixelSize_, n0 = j*kPixelSize_;
-  if (pixel_buffer_[i][j] == 1) {
-    for (int dm = 0; dm < kPixelSize_; ++dm) {
-      for (int dn = 0; dn < kPixelSize_; ++dn) {
-        int idx = ((m0 + dm)*kCols_*kPixelSize_*kChannels_
-                   + (n0 + dn)*kChannels_);
-        display_buffer_[idx + 0] = foreground_red_pixel_value_;
-        display_buffer_[idx + 1] = foreground_green_pixel_value_;
-        display_buffer_[idx + 2] = foreground_blue_pixel_value_;
-      }
+void Chip8::CompiledInstructions(const int count) {
+  if (!compiled_) {
+    DispatchInstructions<true>(count);
+    return;
+  }
+
+  // The compiled program returns wherever it has no block to run (computed
+  // jumps, code outside the ROM, or a block that doesn't fit in the budget);
+  // interpret one instruction there and try again
+  int remaining = count;
+  while (remaining > 0) {
+    if (!compiled_stale_) remaining -= compiled_->Run(this, remaining);
+    if (remaining > 0) {
+      DispatchInstructions<true>(1);
+      --remaining;
     }
   }
 }
 
-bool Chip8::DrawSpriteToPixelBuffer(
-  const uint8_t& i0, const uint8_t& j0, const uint8_t& n
-) {
-  const int sprite_width = 8, sprite_height = n;
-  bool collision_flag = false;
-  for (int di = 0; di < sprite_height; ++di) {
-    uint8_t byte_of_sprite = memory_[index_ + di];
-    for (int dj = 0; dj < sprite_width; ++dj) {
-      if ( (byte_of_sprite << dj) & 0x80 ) {
-        collision_flag |= TogglePixel(i0 + di, j0 + dj);
-      }
+template <bool kCached, bool kFused>
+void Chip8::DispatchInstructions(const int count) {
+  if (count <= 0) return;
+#if defined(__GNUC__)
+  // Threaded code: each handler jumps straight to the next one through
+  // instruction_table_, so there is one indirect branch per handler (which
+  // predicts better than a single shared one) and the handlers inline
+  static void* const kLabels[kNumDecodedOps] = {
+    &&op_00E0, &&op_00EE, &&op_1nnn, &&op_2nnn, &&op_3xkk, &&op_4xkk,
+    &&op_5xy0, &&op_6xkk, &&op_7xkk, &&op_8xy0, &&op_8xy1, &&op_8xy2,
+    &&op_8xy3, &&op_8xy4, &&op_8xy5, &&op_8xy6, &&op_8xy7, &&op_8xyE,
+    &&op_9xy0, &&op_Annn, &&op_Bnnn, &&op_Cxkk, &&op_Dxyn, &&op_Ex9E,
+    &&op_ExA1, &&op_Fx07, &&op_Fx0A, &&op_Fx15, &&op_Fx18, &&op_Fx1E,
+    &&op_Fx29, &&op_Fx33, &&op_Fx55, &&op_Fx65, &&op_Unknown,
+    &&op_Fx07_3xkk_1nnn, &&op_3xkk_1nnn, &&op_4xkk_1nnn, &&op_6xkk_Ex9E,
+    &&op_6xkk_ExA1, &&op_6xkk_6xkk, &&op_6xkk_8xy5, &&op_7xkk_3xkk,
+    &&op_7xkk_6xkk, &&op_8xy5_4xkk, &&op_Annn_Dxyn, &&op_Annn_Fx1E,
+    &&op_Fx1E_Dxyn, &&op_Fx1E_Fx65
+  };
+  int remaining = count;
+  uint16_t opcode, next;
+  Opcode op;
+
+#  define CHIP8_DISPATCH()                                          \
+    op = kCached ? FetchDecoded<kFused>(&opcode) : Fetch(&opcode);  \
+    pc_ += 2;                                                       \
+    goto *kLabels[op]
+#  define CHIP8_NEXT()                                              \
+    if (--remaining == 0) return;                                   \
+    CHIP8_DISPATCH()
+  // Superinstruction: run the first handler, then each of the rest directly,
+  // unless the one before branched or the budget has run out
+#  define CHIP8_FIRST(Handler)                                      \
+    next = pc_;                                                     \
+    Handler(opcode)
+#  define CHIP8_THEN(Handler)                                       \
+    if (pc_ != next) { CHIP8_NEXT(); }                              \
+    if (--remaining == 0) return;                                   \
+    opcode = OpcodeAt(pc_);                                         \
+    pc_ += 2;                                                       \
+    next = pc_;                                                     \
+    Handler(opcode)
+
+  CHIP8_DISPATCH();
+  op_00E0: Op00E0<NoTrace>(opcode); CHIP8_NEXT();
+  op_00EE: Op00EE<NoTrace>(opcode); CHIP8_NEXT();
+  op_1nnn: Op1nnn<NoTrace>(opcode); CHIP8_NEXT();
+  op_2nnn: Op2nnn<NoTrace>(opcode); CHIP8_NEXT();
+  op_3xkk: Op3xkk<NoTrace>(opcode); CHIP8_NEXT();
+  op_4xkk: Op4xkk<NoTrace>(opcode); CHIP8_NEXT();
+  op_5xy0: Op5xy0<NoTrace>(opcode); CHIP8_NEXT();
+  op_6xkk: Op6xkk<NoTrace>(opcode); CHIP8_NEXT();
+  op_7xkk: Op7xkk<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy0: Op8xy0<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy1: Op8xy1<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy2: Op8xy2<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy3: Op8xy3<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy4: Op8xy4<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy5: Op8xy5<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy6: Op8xy6<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xy7: Op8xy7<NoTrace>(opcode); CHIP8_NEXT();
+  op_8xyE: Op8xyE<NoTrace>(opcode); CHIP8_NEXT();
+  op_9xy0: Op9xy0<NoTrace>(opcode); CHIP8_NEXT();
+  op_Annn: OpAnnn<NoTrace>(opcode); CHIP8_NEXT();
+  op_Bnnn: OpBnnn<NoTrace>(opcode); CHIP8_NEXT();
+  op_Cxkk: OpCxkk<NoTrace>(opcode); CHIP8_NEXT();
+  op_Dxyn: OpDxyn<NoTrace>(opcode); CHIP8_NEXT();
+  op_Ex9E: OpEx9E<NoTrace>(opcode); CHIP8_NEXT();
+  op_ExA1: OpExA1<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx07: OpFx07<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx0A: OpFx0A<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx15: OpFx15<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx18: OpFx18<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx1E: OpFx1E<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx29: OpFx29<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx33: OpFx33<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx55: OpFx55<NoTrace>(opcode); CHIP8_NEXT();
+  op_Fx65: OpFx65<NoTrace>(opcode); CHIP8_NEXT();
+  op_Unknown: OpUnknown(opcode); CHIP8_NEXT();
+
+  op_Fx07_3xkk_1nnn:
+    CHIP8_FIRST(OpFx07<NoTrace>); CHIP8_THEN(Op3xkk<NoTrace>); CHIP8_THEN(Op1nnn<NoTrace>); CHIP8_NEXT();
+  op_3xkk_1nnn: CHIP8_FIRST(Op3xkk<NoTrace>); CHIP8_THEN(Op1nnn<NoTrace>); CHIP8_NEXT();
+  op_4xkk_1nnn: CHIP8_FIRST(Op4xkk<NoTrace>); CHIP8_THEN(Op1nnn<NoTrace>); CHIP8_NEXT();
+  op_6xkk_Ex9E: CHIP8_FIRST(Op6xkk<NoTrace>); CHIP8_THEN(OpEx9E<NoTrace>); CHIP8_NEXT();
+  op_6xkk_ExA1: CHIP8_FIRST(Op6xkk<NoTrace>); CHIP8_THEN(OpExA1<NoTrace>); CHIP8_NEXT();
+  op_6xkk_6xkk: CHIP8_FIRST(Op6xkk<NoTrace>); CHIP8_THEN(Op6xkk<NoTrace>); CHIP8_NEXT();
+  op_6xkk_8xy5: CHIP8_FIRST(Op6xkk<NoTrace>); CHIP8_THEN(Op8xy5<NoTrace>); CHIP8_NEXT();
+  op_7xkk_3xkk: CHIP8_FIRST(Op7xkk<NoTrace>); CHIP8_THEN(Op3xkk<NoTrace>); CHIP8_NEXT();
+  op_7xkk_6xkk: CHIP8_FIRST(Op7xkk<NoTrace>); CHIP8_THEN(Op6xkk<NoTrace>); CHIP8_NEXT();
+  op_8xy5_4xkk: CHIP8_FIRST(Op8xy5<NoTrace>); CHIP8_THEN(Op4xkk<NoTrace>); CHIP8_NEXT();
+  op_Annn_Dxyn: CHIP8_FIRST(OpAnnn<NoTrace>); CHIP8_THEN(OpDxyn<NoTrace>); CHIP8_NEXT();
+  op_Annn_Fx1E: CHIP8_FIRST(OpAnnn<NoTrace>); CHIP8_THEN(OpFx1E<NoTrace>); CHIP8_NEXT();
+  op_Fx1E_Dxyn: CHIP8_FIRST(OpFx1E<NoTrace>); CHIP8_THEN(OpDxyn<NoTrace>); CHIP8_NEXT();
+  op_Fx1E_Fx65: CHIP8_FIRST(OpFx1E<NoTrace>); CHIP8_THEN(OpFx65<NoTrace>); CHIP8_NEXT();
+
+#  undef CHIP8_THEN
+#  undef CHIP8_FIRST
+#  undef CHIP8_NEXT
+#  undef CHIP8_DISPATCH
+#else
+  // No superinstructions without computed goto
+  for (int i = 0; i < count; ++i) {
+    uint16_t opcode;
+    const Opcode op = kCached ? FetchDecoded<false>(&opcode) : Fetch(&opcode);
+    pc_ += 2;
+    (this->*kInstructions_[op])(opcode);
+  }
+#endif
+}
+
+inline Chip8::Opcode Chip8::Fetch(uint16_t* opcode) {
+  *opcode = OpcodeAt(pc_);
+  return instruction_table_[*opcode];
+}
+
+template <bool kFused>
+inline Chip8::Opcode Chip8::FetchDecoded(uint16_t* opcode) {
+  // pc_ can run off the end of memory_ (e.g. Bnnn); don't cache there
+  if (pc_ >= kMemorySize_ - 1) return Fetch(opcode);
+
+  DecodedInstruction& decoded = decode_cache_[pc_];
+  if (decoded.op == kOpUndecoded) {
+    decoded.op = Fetch(&decoded.opcode);
+    if (kFused) decoded.op = Fuse(pc_, decoded.op);
+  }
+  *opcode = decoded.opcode;
+  return decoded.op;
+}
+
+inline Chip8::Opcode Chip8::Fuse(const int address, const Opcode op) {
+  Opcode sequence[3] = {op, kNumOps, kNumOps};
+  for (int i = 1; i < 3 && address + 2*i + 1 < kMemorySize_; ++i) {
+    sequence[i] = instruction_table_[
+      memory_[address + 2*i] << 8 | memory_[address + 2*i + 1]];
+  }
+  for (int i = 0; i < kNumSuperinstructions_; ++i) {
+    const Opcode* fused = kSuperinstructions_[i].sequence;
+    if (fused[0] == sequence[0] && fused[1] == sequence[1]
+      && (fused[2] == kNumOps || fused[2] == sequence[2])) {
+      return kSuperinstructions_[i].fused;
     }
   }
-  return collision_flag;
+  return op;
 }
 
-void Chip8::DrawPixelsToDisplayBuffer() {
-  ClearDisplayBuffer();
-  for (int i = 0; i < kRows_; ++i) {
-    for (int j = 0; j < kCols_; ++j) DrawPixelToDisplayBuffer(i, j);
+/*
+  Instruction handlers; pc_ has already been advanced past the opcode, and
+  each handler extracts only the opcode fields it uses
+*/
+template <typename Trace>
+inline void Chip8::Op00E0(const uint16_t opcode) {  // 00E0: CLR
+  static_cast<void>(opcode);
+  DebugMessage<Trace>(
+    "[0x00E0: CLR]\n"
+    "    Clear screen.\n");
+  ClearPixelBuffer();
+}
+
+template <typename Trace>
+inline void Chip8::Op00EE(const uint16_t opcode) {  // 00EE: RET
+  static_cast<void>(opcode);
+  DebugMessage<Trace>(
+    "[0x00EE: RET]\n"
+    "    Return: set sp -= 1 = 0x%02X; pc = stack[sp] = 0x%04X.\n",
+    sp_ - 1,
+    stack_[(sp_ - 1) & (kStackSize_ - 1)]);
+  pc_ = stack_[--sp_ & (kStackSize_ - 1)];
+}
+
+template <typename Trace>
+inline void Chip8::Op1nnn(const uint16_t opcode) {  // 1nnn: JP addr
+  const uint16_t nnn = opcode & 0x0FFF;
+  DebugMessage<Trace>(
+    "[0x1nnn: JP addr]\n"
+    "    Jump to address nnn: set pc = 0x%04X.\n",
+    nnn);
+  pc_ = nnn;
+}
+
+template <typename Trace>
+inline void Chip8::Op2nnn(const uint16_t opcode) {  // 2nnn: CALL addr
+  const uint16_t nnn = opcode & 0x0FFF;
+  DebugMessage<Trace>(
+    "[0x2nnn: CALL addr]\n"
+    "    Call address nnn: stack[sp] = pc = 0x%04X;\n"
+    "    sp += 1 = 0x%02X; pc = 0x%04X.\n",
+    pc_, sp_ + 1,
+    nnn);
+  // Stack is a ring of kStackSize_ entries; ROMs that leak frames, e.g. by
+  // jumping out of a subroutine, wrap around instead of overrunning it
+  stack_[sp_++ & (kStackSize_ - 1)] = pc_;
+  pc_ = nnn;
+}
+
+template <typename Trace>
+inline void Chip8::Op3xkk(const uint16_t opcode) {  // 3xkk: SE Vx, byte
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  DebugMessage<Trace>(
+    "[0x3xkk: SE Vx, byte]\n"
+    "    Skip next instruction if Vx == kk: set pc += %d\n"
+    "    because 0x%02X %c= 0x%02X.\n",
+    (v_[x] == kk) ? 2 : 0,
+    v_[x], (v_[x] == kk) ? '=' : '!', kk);
+  pc_ += (v_[x] == kk) ? 2 : 0;
+}
+
+template <typename Trace>
+inline void Chip8::Op4xkk(const uint16_t opcode) {  // 4xkk: SNE Vx, byte
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  DebugMessage<Trace>(
+    "[0x4xkk: SNE Vx, byte]\n"
+    "    Skip next instruction if Vx != kk: set pc += %d\n"
+    "    because 0x%02X %c= 0x%02X.\n",
+    (v_[x] != kk) ? 2 : 0,
+    v_[x], (v_[x] != kk) ? '!' : '=', kk);
+  pc_ += (v_[x] != kk) ? 2 : 0;
+}
+
+template <typename Trace>
+inline void Chip8::Op5xy0(const uint16_t opcode) {  // 5xy0: SE Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x5xy0: SE Vx, Vy]\n"
+    "    Skip next instruction if Vx == Vy: set pc += %d\n"
+    "    because 0x%02X %c= 0x%02X.\n",
+    (v_[x] == v_[y]) ? 2 : 0,
+    v_[x], (v_[x] == v_[y]) ? '=' : '!', v_[y]);
+  pc_ += (v_[x] == v_[y]) ? 2 : 0;
+}
+
+template <typename Trace>
+inline void Chip8::Op6xkk(const uint16_t opcode) {  // 6xkk: LD Vx, byte
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  DebugMessage<Trace>(
+    "[0x6xkk: LD Vx, byte]\n"
+    "    Load byte kk into register Vx: set Vx = 0x%02X.\n", kk);
+  v_[x] = kk;
+}
+
+template <typename Trace>
+inline void Chip8::Op7xkk(const uint16_t opcode) {  // 7xkk: ADD Vx, byte
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  DebugMessage<Trace>(
+    "[0x7xkk: ADD Vx, byte]\n"
+    "    Load Vx + kk into register Vx: set Vx += 0x%02X = 0x%02X.\n",
+    kk, v_[x] + kk);
+  v_[x] += kk;
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy0(const uint16_t opcode) {  // 8xy0: LD Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x8xy0: LD Vx, Vy]\n"
+    "    Load Vy into register Vx: set Vx = 0x%02X.\n",
+    v_[y]);
+  v_[x] = v_[y];
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy1(const uint16_t opcode) {  // 8xy1: OR Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x8xy1: OR Vx, Vy]\n"
+    "    Load Vx | Vy into register Vx:\n"
+    "    set Vx = 0x%02X | 0x%02X = 0x%02X.\n",
+    v_[x], v_[y], v_[x] | v_[y]);
+  v_[x] |= v_[y];
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy2(const uint16_t opcode) {  // 8xy2: AND Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x8xy2: AND Vx, Vy]\n"
+    "    Load Vx & Vy into register Vx:\n"
+    "    set Vx = 0x%02X & 0x%02X = 0x%02X.\n",
+    v_[x], v_[y], v_[x] & v_[y]);
+  v_[x] &= v_[y];
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy3(const uint16_t opcode) {  // 8xy3: XOR Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x8xy3: XOR Vx, Vy]\n"
+    "    Load Vx ^ Vy into register Vx:\n"
+    "    set Vx = 0x%02X ^ 0x%02X = 0x%02X.\n",
+    v_[x], v_[y], v_[x] ^ v_[y]);
+  v_[x] ^= v_[y];
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy4(const uint16_t opcode) {  // 8xy4: ADD Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  const int carry = ((static_cast<int>(v_[x]) + static_cast<int>(v_[y])) > 255) ? 1 : 0;
+  const int res = v_[x] + v_[y];
+  DebugMessage<Trace>(
+    "[0x8xy4: ADD Vx, Vy]\n"
+    "    Store Vx + Vy into register Vx: store carry VF = %d\n"
+    "    and set Vx = 0x%02X + 0x%02X = 0x%02X.\n",
+    carry,
+    v_[x], v_[y], res);
+  v_[x] = res;
+  v_[0xF] = carry;
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy5(const uint16_t opcode) {  // 8xy5: SUB Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  const int no_borrow = (v_[x] >= v_[y]) ? 1 : 0;
+  const int res = v_[x] - v_[y];
+  DebugMessage<Trace>(
+    "[0x8xy5: SUB Vx, Vy]\n"
+    "    Store Vx - Vy into register Vx: store carry VF = %d\n"
+    "    because Vx %s Vy and set Vx = 0x%02X - 0x%02X = 0x%02X.\n",
+    no_borrow, no_borrow ?  ">=" : "<",
+    v_[x], v_[y], res);
+  v_[x] = res;
+  v_[0xF] = no_borrow;
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy6(const uint16_t opcode) {  // 8xy6: SHR Vx {, Vy}
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const int lsb = v_[x] & 0x01;
+  const int res = v_[x] >> 1;
+  DebugMessage<Trace>(
+    "[0x8xy6: SHR Vx{, Vy}]\n"
+    "    Shift right Vx one bit: store least significant bit VF = %d\n"
+    "    and set Vx = (0x%02X >> 1) = 0x%02X.\n",
+    lsb,
+    v_[x], res);
+  v_[x] = res;
+  v_[0xF] = lsb;
+}
+
+template <typename Trace>
+inline void Chip8::Op8xy7(const uint16_t opcode) {  // 8xy7: SUBN Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  const int no_borrow = (v_[y] >= v_[x]) ?  1 : 0;
+  const int res = v_[y] - v_[x];
+  DebugMessage<Trace>(
+    "[0x8xy7: SUBN Vx, Vy]\n"
+    "    Store Vy - Vx into register Vx: store carry VF = %d\n"
+    "    because Vy %s Vx and set Vx = 0x%02X - 0x%02X = 0x%02X.\n",
+    no_borrow, no_borrow ? ">=" : "<",
+    v_[y], v_[x], res);
+  v_[x] = res;
+  v_[0xF] = no_borrow;
+}
+
+template <typename Trace>
+inline void Chip8::Op8xyE(const uint16_t opcode) {  // 8xyE: SHL Vx{, Vy}
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const int msb = v_[x] & 0x80 ? 1 : 0;
+  const int res = v_[x] << 1;
+  DebugMessage<Trace>(
+    "[0x8xyE: SHL Vx{, Vy}]\n"
+    "    Shift left Vx one bit: store most significant bit VF = %d\n"
+    "    and set Vx = (0x%02X << 1) = 0x%02X.\n",
+    msb,
+    v_[x], res);
+  v_[x] = res;
+  v_[0xF] = msb;
+}
+
+template <typename Trace>
+inline void Chip8::Op9xy0(const uint16_t opcode) {  // 9xy0: SNE Vx, Vy
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  DebugMessage<Trace>(
+    "[0x9xy0: SNE Vx, Vy]\n"
+    "    Skip next instruction if Vx != Vy: set pc += %d\n"
+    "    because 0x%02X %c= 0x%02X.\n",
+    (v_[x] != v_[y]) ? 2 : 0,
+    v_[x], (v_[x] != v_[y]) ? '!' : '=', v_[y]);
+  pc_ += (v_[x] != v_[y]) ? 2 : 0;
+}
+
+template <typename Trace>
+inline void Chip8::OpAnnn(const uint16_t opcode) {  // Annn: LD I, addr
+  const uint16_t nnn = opcode & 0x0FFF;
+  DebugMessage<Trace>(
+    "[0xAnnn: LD I, addr]\n"
+    "    Load address nnn into register I: set index = 0x%03X.\n",
+    nnn);
+  index_ = nnn;
+}
+
+template <typename Trace>
+inline void Chip8::OpBnnn(const uint16_t opcode) {  // Bnnn: JP V0, addr
+  const uint16_t nnn = opcode & 0x0FFF;
+  DebugMessage<Trace>(
+    "[0xBnnn: JP V0, addr]\n"
+    "    Jump to address nnn + V0: set pc = 0x%03X + 0x%02X = 0x%04X.\n",
+    nnn, v_[0], nnn + v_[0]);
+  pc_ = nnn + v_[0];
+}
+
+template <typename Trace>
+inline void Chip8::OpCxkk(const uint16_t opcode) {  // Cxkk: RND Vx, byte
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  const uint8_t res = (random_.Next() >> 24) & kk;
+  DebugMessage<Trace>(
+    "[0xCxkk: RND Vx, byte]\n"
+    "    Load random byte & kk into register Vx:\n"
+    "    set Vx = random byte & 0x%02X = 0x%02X.\n",
+    kk, res);
+  v_[x] = res;
+}
+
+template <typename Trace>
+inline void Chip8::OpDxyn(const uint16_t opcode) {  // Dxyn: DRW Vx, Vy, nibble
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  const uint8_t n = opcode & 0x000F;
+  uint8_t collision = DrawSpriteToPixelBuffer(v_[y], v_[x], n) ? 1 : 0;
+  DebugMessage<Trace>(
+    "[0xDxyn: DRW Vx, Vy, nibble]\n"
+    "    Draw %d-byte sprite starting at memory location I = 0x%03X\n"
+    "    at (Vx, Vy) = (0x%02X, 0x%02X); set VF = %d (collision).\n",
+    n,
+    index_,
+    v_[x], v_[y], collision);
+  v_[0xF] = collision;
+}
+
+template <typename Trace>
+inline void Chip8::OpEx9E(const uint16_t opcode) {  // Ex9E: SKP Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const bool pressed = KeyIsPressed(v_[x]);
+  DebugMessage<Trace>(
+    "[0xEx9E: SKP Vx]\n"
+    "    Skip next instruction if key with value Vx is pressed:\n"
+    "    set pc += %d because Vx = 0x%02X\n"
+    "    and KeyIsPressed(0x%02X) == %s.\n",
+    pressed ? 2 : 0, v_[x], v_[x], pressed ? "true" : "false");
+  if (pressed) pc_ += 2;
+}
+
+template <typename Trace>
+inline void Chip8::OpExA1(const uint16_t opcode) {  // ExA1: SKNP Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const bool pressed = KeyIsPressed(v_[x]);
+  DebugMessage<Trace>(
+    "[0xExA1: SKNP Vx]\n"
+    "    Skip next instruction if key with value Vx is not pressed:\n"
+    "    set pc += %d because Vx = 0x%02X\n"
+    "    and KeyIsPressed(0x%02X) == %s.\n",
+    !pressed ? 2 : 0, v_[x], v_[x], pressed ? "true" : "false");
+  if (!pressed) pc_ += 2;
+}
+
+template <typename Trace>
+inline void Chip8::OpFx07(const uint16_t opcode) {  // Fx07: LD Vx, DT
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx07: LD Vx, DT]\n"
+    "    Load delay timer into register Vx:\n"
+    "    set Vx = delay_timer = 0x%02X.\n",
+    delay_timer_);
+  v_[x] = delay_timer_;
+}
+
+template <typename Trace>
+inline void Chip8::OpFx0A(const uint16_t opcode) {  // Fx0A: LD Vx, K
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx0A: LD Vx, K]\n"
+    "    Wait for any keypress and store into register Vx:\n");
+  // Rather than block here, re-execute this instruction until a key
+  // is pressed: the machine waits here across frames with its timers
+  // running, EmulateCycle skips the rest of each such frame (see
+  // IdleLoopLength), and a headless frontend can't hang the interpreter
+  if (keys_) {
+    uint8_t key = 0;
+    while (!((keys_ >> key) & 1)) ++key;
+    v_[x] = key;  // Lowest key held
+    DebugMessage<Trace>("    stored 0x%02X into register Vx.\n", v_[x]);
+  } else {
+    DebugMessage<Trace>("    no key pressed; wait.\n");
+    pc_ -= 2;
+  }
+}
+
+template <typename Trace>
+inline void Chip8::OpFx15(const uint16_t opcode) {  // Fx15: LD DT, Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx15: LD DT, Vx]\n"
+    "    Set delay timer to value stored in register Vx:\n"
+    "    set delay_timer = Vx = 0x%02X.\n",
+    v_[x]);
+  delay_timer_ = v_[x];
+}
+
+template <typename Trace>
+inline void Chip8::OpFx18(const uint16_t opcode) {  // Fx18: LD ST, Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx18: LD ST, Vx]\n"
+    "    Set sound timer to value stored in register Vx:\n"
+    "    set sound_timer = Vx = 0x%02X.\n",
+    v_[x]);
+  sound_timer_ = v_[x];
+}
+
+template <typename Trace>
+inline void Chip8::OpFx1E(const uint16_t opcode) {  // Fx1E: ADD I, Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx1E: ADD I, Vx]\n"
+    "    Add value store in Vx to register I:\n"
+    "    set index += 0x%02X = 0x%03X.\n",
+    v_[x], index_ + v_[x]);
+  index_ += v_[x];
+}
+
+template <typename Trace>
+inline void Chip8::OpFx29(const uint16_t opcode) {  // Fx29: LD F, Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx29: LD F, Vx]\n"
+    "    Set register I to location of sprite for digit Vx:\n"
+    "    set index = 0x%02X*0x%02X = 0x%03X.\n",
+    kBytesPerFontSprite_, v_[x], kBytesPerFontSprite_*v_[x]);
+  index_ = kBytesPerFontSprite_*v_[x];
+}
+
+template <typename Trace>
+inline void Chip8::OpFx33(const uint16_t opcode) {  // Fx33: LD B, Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx33: LD B, Vx]\n"
+    "    Load Binary Coded Decimal representation of Vx in memory:\n"
+    "    memory[0x%03X] = 0x%02X\n"
+    "    memory[0x%03X] = 0x%02X\n"
+    "    memory[0x%03X] = 0x%02X.\n",
+    index_    , (v_[x]/100)%10,
+    index_ + 1, (v_[x]/ 10)%10,
+    index_ + 2, (v_[x]/  1)%10);
+  SetByteAt(index_    , (v_[x]/100)%10);  // Vx hundreds digit store at I
+  SetByteAt(index_ + 1, (v_[x]/ 10)%10);  // Vx tens digit store at I+1
+  SetByteAt(index_ + 2, (v_[x]/  1)%10);  // Vx ones digit store at I+2
+  InvalidateDecodeCache(index_, 3);
+}
+
+template <typename Trace>
+inline void Chip8::OpFx55(const uint16_t opcode) {  // Fx55: LD [I], Vx
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx55: LD [I], Vx]\n"
+    "    Store registers V0 through Vx in memory\n"
+    "    starting at I = 0x%03X:",
+    index_);
+  for (int i = 0; i <= x; ++i) {
+    DebugMessage<Trace>(
+      "\n    memory[0x%03X] = V%d = 0x%02X",
+      index_ + i, i, v_[i]);
+  }
+  DebugMessage<Trace>(".\n");
+
+  for (int i = 0; i <= x; ++i) SetByteAt(index_ + i, v_[i]);
+  InvalidateDecodeCache(index_, x + 1);
+}
+
+template <typename Trace>
+inline void Chip8::OpFx65(const uint16_t opcode) {  // Fx65: LD Vx, [I]
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  DebugMessage<Trace>(
+    "[0xFx65: LD Vx, [I] ]\n"
+    "    Load from memory into registers V0 through Vx\n"
+    "    starting at I = 0x%03X:",
+    index_);
+  for (int i = 0; i <= x; ++i) {
+    DebugMessage<Trace>(
+      "\n    V%d = memory[0x%03X] = 0x%02X",
+      i, index_ + i, ByteAt(index_ + i));
+  }
+  DebugMessage<Trace>(".\n");
+
+  for (int i = 0; i <= x; ++i) v_[i] = ByteAt(index_ + i);
+}
+
+void Chip8::OpUnknown(const uint16_t opcode) {
+  UnknownInstruction(opcode);
+}
+
+void Chip8::ClearPixelBuffer() {
+  for (int i = 0; i < kRows_; ++i) pixel_buffer_[i] = 0;
+  MarkDirty(0, kRows_);
+}
+
+bool Chip8::DrawSpriteToPixelBuffer(
+  const uint8_t& i0, const uint8_t& j0, const uint8_t& n
+) {
+  // Sprite rows wrap around in x; rotate each into place at column j0
+  const int shift = j0%kCols_;
+  uint64_t collision = 0;
+  for (int di = 0; di < n; ++di) {
+    // Chip-8 specification does not say whether to wrap around in y,
+    // some ROMs are written assuming yes and others no
+    int i = i0 + di;
+    if (!wrap_around_y_ && i >= kRows_) break;
+    i %= kRows_;
+
+    const uint64_t row = static_cast<uint64_t>(ByteAt(index_ + di)) << 56;
+    const uint64_t sprite = shift ? (row >> shift | row << (64 - shift)) : row;
+    if (!sprite) continue;
+    collision |= pixel_buffer_[i] & sprite;
+    pixel_buffer_[i] ^= sprite;
+    MarkDirty(i, i + 1);
   }
+  return collision != 0;
 }
 
 void Chip8::LoadFontSprites() {
@@ -646,19 +1099,339 @@ void Chip8::UpdateTimers() {
   sound_timer_ -= (sound_timer_ > 0) ? 1 : 0;
 }
 
-void Chip8::EmulateCycle() {
-  for (int i = 0; i < speed_; ++i) {
-    uint16_t opcode = (memory_[pc_] << 8 | memory_[pc_ + 1]);
-    InterpretInstruction(opcode);
+// FNV-1a, continuing from hash
+static uint64_t Fnv1a(uint64_t hash, const void* data, const size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
   }
+  return hash;
+}
 
-  UpdateTimers();
+uint64_t Chip8::StateHash() const {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = Fnv1a(hash, memory_, kMemorySize_);
+  hash = Fnv1a(hash, v_, kRegistersSize_);
+  hash = Fnv1a(hash, stack_, kStackSize_*sizeof(stack_[0]));
+  hash = Fnv1a(hash, &index_, sizeof(index_));
+  hash = Fnv1a(hash, &pc_, sizeof(pc_));
+  hash = Fnv1a(hash, &sp_, sizeof(sp_));
+  hash = Fnv1a(hash, &delay_timer_, sizeof(delay_timer_));
+  hash = Fnv1a(hash, &sound_timer_, sizeof(sound_timer_));
+  hash = Fnv1a(hash, pixel_buffer_, kRows_*sizeof(pixel_buffer_[0]));
+  hash = Fnv1a(hash, random_.state_, sizeof(random_.state_));
+  return hash;
+}
+
+uint64_t Chip8::ScreenHash() const {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = Fnv1a(hash, pixel_buffer_, kRows_*sizeof(pixel_buffer_[0]));
+  return hash;
+}
+
+const char Chip8::kStateMagic_[] = "CH8S";
+const uint16_t Chip8::kStateVersion_ = 2;
+
+// Little-endian fields of a snapshot
+static void Put(std::vector<uint8_t>* image, const uint64_t value,
+                const int bytes) {
+  for (int i = 0; i < bytes; ++i) image->push_back((value >> 8*i) & 0xFF);
+}
+
+static bool Get(const std::vector<uint8_t>& image, size_t* at,
+                const int bytes, uint64_t* value) {
+  if (*at + bytes > image.size()) return false;
+  *value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    *value |= static_cast<uint64_t>(image[(*at)++]) << 8*i;
+  }
+  return true;
+}
+
+static bool GetRandom(const std::vector<uint8_t>& image, size_t* at,
+                      Xoshiro128* random) {
+  uint64_t value;
+  for (int i = 0; i < 4; ++i) {
+    if (!Get(image, at, 4, &value)) return false;
+    random->state_[i] = static_cast<uint32_t>(value);
+  }
+  return true;
+}
+
+void Chip8::SaveState(std::vector<uint8_t>* image) const {
+  image->clear();
+  for (int i = 0; i < 4; ++i) image->push_back(kStateMagic_[i]);
+  Put(image, kStateVersion_, 2);
+
+  // Machine
+  image->insert(image->end(), memory_, memory_ + kMemorySize_);
+  image->insert(image->end(), v_, v_ + kRegistersSize_);
+  for (int i = 0; i < kStackSize_; ++i) Put(image, stack_[i], 2);
+  for (int i = 0; i < kRows_; ++i) Put(image, pixel_buffer_[i], 8);
+  Put(image, pc_, 2);
+  Put(image, index_, 2);
+  Put(image, sp_, 1);
+  Put(image, delay_timer_, 1);
+  Put(image, sound_timer_, 1);
+  Put(image, keys_, 2);
+  for (int i = 0; i < 4; ++i) Put(image, random_.state_[i], 4);
+
+  // Configuration
+  uint64_t bits;
+  Put(image, wrap_around_y_, 1);
+  std::memcpy(&bits, &instructions_per_second_, sizeof(bits));
+  Put(image, bits, 8);
+  std::memcpy(&bits, &budget_carry_, sizeof(bits));
+  Put(image, bits, 8);
+  Put(image, program_size_, 2);
+}
+
+bool Chip8::LoadState(const std::vector<uint8_t>& image) {
+  size_t at = 6;
+  uint64_t value;
+  if (image.size() < at || std::memcmp(&image[0], kStateMagic_, 4)
+   || (image[4] | image[5] << 8) != kStateVersion_) {
+    return false;
+  }
+
+  // Read into a copy, so a short image changes nothing
+  Chip8State state = *this;
+  if (image.size() < at + kMemorySize_ + kRegistersSize_) return false;
+  std::memcpy(state.memory_, &image[at], kMemorySize_);
+  at += kMemorySize_;
+  std::memcpy(state.v_, &image[at], kRegistersSize_);
+  at += kRegistersSize_;
+  for (int i = 0; i < kStackSize_; ++i) {
+    if (!Get(image, &at, 2, &value)) return false;
+    state.stack_[i] = value;
+  }
+  for (int i = 0; i < kRows_; ++i) {
+    if (!Get(image, &at, 8, &state.pixel_buffer_[i])) return false;
+  }
+  uint64_t pc, index, sp, delay_timer, sound_timer, keys;
+  uint64_t wrap_around_y, instructions_per_second, budget_carry, program_size;
+  if (!Get(image, &at, 2, &pc) || !Get(image, &at, 2, &index)
+   || !Get(image, &at, 1, &sp) || !Get(image, &at, 1, &delay_timer)
+   || !Get(image, &at, 1, &sound_timer) || !Get(image, &at, 2, &keys)
+   || !GetRandom(image, &at, &state.random_)
+   || !Get(image, &at, 1, &wrap_around_y)
+   || !Get(image, &at, 8, &instructions_per_second)
+   || !Get(image, &at, 8, &budget_carry)
+   || !Get(image, &at, 2, &program_size)
+   || at != image.size()) {
+    return false;
+  }
+  state.pc_ = pc;
+  state.index_ = index;
+  state.sp_ = sp;
+  state.delay_timer_ = delay_timer;
+  state.sound_timer_ = sound_timer;
+  state.keys_ = keys;
+
+  // Values no machine can be in
+  double ips, carry;
+  std::memcpy(&ips, &instructions_per_second, sizeof(ips));
+  std::memcpy(&carry, &budget_carry, sizeof(carry));
+  if (index >= static_cast<uint64_t>(kMemorySize_)
+   || program_size > static_cast<uint64_t>(kMaxProgramSize_)
+   || wrap_around_y > 1
+   || !std::isfinite(ips) || ips <= 0.
+   || !(carry >= 0. && carry < 1.)) {
+    return false;
+  }
+
+  static_cast<Chip8State&>(*this) = state;
+  wrap_around_y_ = wrap_around_y;
+  instructions_per_second_ = ips;
+  budget_carry_ = carry;
+  program_size_ = program_size;
+
+  // Decoded and translated code is for the old memory; the compiled
+  // program is used only if memory still holds its ROM unchanged
+  InvalidateDecodeCache();
+  compiled_ = CompiledProgram::Find(&memory_[kProgramAddress_], program_size_);
+  compiled_stale_ = false;
+  MarkDirty(0, kRows_);
+  return true;
+}
+
+bool Chip8::SaveStateFile(const std::string& path) const {
+  std::vector<uint8_t> image;
+  SaveState(&image);
+  FILE* file = std::fopen(path.c_str(), "wb");
+  if (!file
+   || std::fwrite(&image[0], 1, image.size(), file) != image.size()) {
+    std::fprintf(stderr, "In Chip8::SaveStateFile: cannot write %s\n",
+                 path.c_str());
+    if (file) std::fclose(file);
+    return false;
+  }
+  std::fclose(file);
+  return true;
+}
+
+bool Chip8::LoadStateFile(const std::string& path) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    std::fprintf(stderr, "In Chip8::LoadStateFile: file does not exist: %s\n",
+                 path.c_str());
+    return false;
+  }
+  std::vector<uint8_t> image;
+  uint8_t buffer[4096];
+  for (size_t n; (n = std::fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+    image.insert(image.end(), buffer, buffer + n);
+  }
+  std::fclose(file);
+  if (!LoadState(image)) {
+    std::fprintf(stderr, "In Chip8::LoadStateFile: not a valid version %d "
+                 "state: %s\n", kStateVersion_, path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void Chip8::RunCommands() {
+  for (KeyboardInterface::Command command = keyboard_->TakeCommand();
+       command != KeyboardInterface::kNoCommand;
+       command = keyboard_->TakeCommand()) {
+    if (command == KeyboardInterface::kSaveState) {
+      if (SaveStateFile(state_path_)) {
+        std::printf("Saved state to %s\n", state_path_.c_str());
+      }
+    } else if (command == KeyboardInterface::kLoadState) {
+      if (LoadStateFile(state_path_)) {
+        std::printf("Loaded state from %s\n", state_path_.c_str());
+      }
+    }
+  }
+}
+
+int Chip8::IdleLoopLength() {
+  if (pc_ >= kMemorySize_ - 1) return 0;
+  const uint16_t opcode = OpcodeAt(pc_);
+
+  // Start of the delay timer poll pc_ may be in
+  int start;
+  switch (opcode & 0xF000) {
+    case 0x1000: {
+      if ((opcode & 0x0FFF) == pc_) return 1;  // Jump to itself
+      start = pc_ - 4;
+      break;
+    }
+    case 0x3000: case 0x4000: start = pc_ - 2; break;
+    case 0xF000: {
+      if ((opcode & 0x00FF) == 0x000A) {
+        // Key wait with no key pressed re-executes itself
+        return keys_ ? 0 : 1;
+      }
+      start = pc_;
+      break;
+    }
+    default: return 0;
+  }
+
+  // Fx07; 3xkk or 4xkk; 1nnn back to the Fx07 loops without changing state
+  // only while Vx already holds the timer and the skip isn't taken
+  if (start < 0 || start + 5 >= kMemorySize_) return 0;
+  const uint16_t load = memory_[start] << 8 | memory_[start + 1];
+  const uint16_t skip = memory_[start + 2] << 8 | memory_[start + 3];
+  const uint16_t jump = memory_[start + 4] << 8 | memory_[start + 5];
+  const uint8_t x = (load >> 8) & 0x000F;
+  const uint8_t kk = skip & 0x00FF;
+  if ((load & 0xF0FF) != 0xF007 || jump != (0x1000 | start)
+    || (skip & 0x0F00) != (load & 0x0F00) || v_[x] != delay_timer_) {
+    return 0;
+  }
+  if ((skip & 0xF000) == 0x3000 && v_[x] != kk) return 3;
+  if ((skip & 0xF000) == 0x4000 && v_[x] == kk) return 3;
+  return 0;
+}
+
+void Chip8::ExecuteInstructions(const int count) {
+  if (tracing_ == kPrintTracing) {
+    InterpretInstructions<PrintTrace>(count);
+  } else if (tracing_ == kStepTracing) {
+    InterpretInstructions<StepTrace>(count);
+  } else if (dispatch_ == kTableDispatch) {
+    DispatchInstructions<false>(count);
+  } else if (dispatch_ == kCachedDispatch) {
+    DispatchInstructions<true>(count);
+  } else if (dispatch_ == kFusedDispatch) {
+    DispatchInstructions<true, true>(count);
+  } else if (dispatch_ == kJitDispatch) {
+    JitInstructions(count);
+  } else if (dispatch_ == kCompiledDispatch) {
+    CompiledInstructions(count);
+  } else {
+    InterpretInstructions<NoTrace>(count);
+  }
+}
+
+void Chip8::RunInstructions(const int budget) {
+  if (!skip_idle_loops_ || tracing_ != kNoTracing) {
+    ExecuteInstructions(budget);
+  } else {
+    int remaining = budget;
+    while (remaining > 0) {
+      const int length = IdleLoopLength();
+      if (length > 0) {
+        ExecuteInstructions(remaining % length);
+        break;
+      }
+      const int count
+        = remaining < kIdleCheckInterval_ ? remaining : kIdleCheckInterval_;
+      ExecuteInstructions(count);
+      remaining -= count;
+    }
+  }
+}
+
+int Chip8::FrameBudget() {
+  budget_carry_ += instructions_per_second_/kFramesPerSecond_;
+  const int budget = static_cast<int>(budget_carry_);
+  budget_carry_ -= budget;
+  return budget;
+}
+
+void Chip8::EmulateCycle() {
+  EmulateFrame();
 
   PlaySound();
 
   Paint();
 }
 
+void Chip8::EmulateFrame() {
+  const int budget = FrameBudget();
+  instructions_ += budget;
+  keys_ = keyboard_->PressedKeys();
+
+  // Split the frame at the key events that happened during it
+  int done = 0;
+  std::chrono::steady_clock::time_point time;
+  while (keyboard_->NextKeyEvent(&time)) {
+    const double fraction
+      = std::chrono::duration<double>(time - frame_begin_).count()
+      /kSecondsPerFrame_;
+    if (fraction >= 1.) break;  // Belongs to a later frame
+    const int at = static_cast<int>(fraction*budget);
+    if (at > done) {
+      RunInstructions(at - done);
+      done = at;
+    }
+    keyboard_->ApplyKeyEvent();
+    keys_ = keyboard_->PressedKeys();
+    if (input_time_ == std::chrono::steady_clock::time_point()) {
+      input_time_ = time;
+    }
+  }
+  RunInstructions(budget - done);
+
+  UpdateTimers();
+}
+
 void Chip8::LoadProgram(const std::string& path_to_rom) {
   FILE* program = std::fopen(path_to_rom.c_str(), "rb");
   if (!program) {
@@ -668,9 +1441,14 @@ void Chip8::LoadProgram(const std::string& path_to_rom) {
     std::exit(EXIT_FAILURE);
   }
 
-  std::fread(&memory_[kProgramAddress_], 1, kMaxProgramSize_, program);
+  program_size_
+    = std::fread(&memory_[kProgramAddress_], 1, kMaxProgramSize_, program);
 
   std::fclose(program);
+
+  InvalidateDecodeCache();
+  compiled_ = CompiledProgram::Find(&memory_[kProgramAddress_], program_size_);
+  compiled_stale_ = false;
 }
 
 void Chip8::LoadProgram(const std::string& path_to_rom,
@@ -690,16 +1468,115 @@ void Chip8::LoadProgram(const std::string& path_to_rom,
 }
 
 void Chip8::Step() {
-  clock_t now = clock();
-  clock_t elapsed_cycles = now - then_;
-  double elapsed_seconds
-    = static_cast<double>(elapsed_cycles)/static_cast<double>(CLOCKS_PER_SEC);
-  if (elapsed_seconds >= kSecondsPerFrame_) {
+  const std::chrono::steady_clock::duration period
+    = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(kSecondsPerFrame_));
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  RunCommands();
+  if (!paced_) {
+    frame_begin_ = now - period;
+    next_frame_ = now;
+    AdvanceFrame();
+    return;
+  }
+  if (now < next_frame_) {
+    std::this_thread::sleep_until(next_frame_);
+    now = std::chrono::steady_clock::now();
+  }
+
+  std::chrono::duration<double> late = now - next_frame_;
+  if (late.count() > kMaxCatchUpFrames_*kSecondsPerFrame_) {
+    // Too far behind to catch up, e.g. after the machine was suspended
+    frame_timing_.dropped
+      += static_cast<int>(late.count()/kSecondsPerFrame_);
+    next_frame_ = now;
+    late = std::chrono::duration<double>(0.);
+  } else if (late.count() >= kSecondsPerFrame_) {
+    frame_timing_.caught_up += 1;
+  }
+
+  frame_begin_ = next_frame_ - period;
+  AdvanceFrame();
+  next_frame_ += period;
+
+  frame_timing_.frames += 1;
+  frame_timing_.late_total += late.count();
+  frame_timing_.late_squares += late.count()*late.count();
+  if (late.count() > frame_timing_.late_max) {
+    frame_timing_.late_max = late.count();
+  }
+}
+
+void Chip8::AdvanceFrame() {
+  if (rewind_ && keyboard_->CommandHeld(KeyboardInterface::kRewind)) {
+    if (rewind_->Pop(&snapshot_)) LoadState(snapshot_);
+    PlaySound();
+    Paint();
+    return;
+  }
+  if (rewind_) {
+    SaveState(&snapshot_);
+    rewind_->Push(snapshot_);
+  }
+  if (run_ahead_ > 0 && tracing_ == kNoTracing) {
+    RunAhead();
+  } else {
     EmulateCycle();
-    then_ = clock();
   }
 }
 
+void Chip8::RunAhead() {
+  EmulateFrame();
+  PlaySound();
+
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+  const Chip8State real = *this;
+  const double budget_carry = budget_carry_;
+  const bool compiled_stale = compiled_stale_;
+  const bool exit_on_unknown = exit_on_unknown_;
+  const int unknown_opcode = unknown_opcode_;
+
+  // An unknown instruction only ends the program if the real frames reach
+  // it, so speculation just stops there
+  exit_on_unknown_ = false;
+  unknown_opcode_ = -1;
+  for (int i = 0; i < run_ahead_ && unknown_opcode_ < 0; ++i) {
+    RunInstructions(FrameBudget());
+    UpdateTimers();
+  }
+  Paint();
+
+  // Dirty rows from here on are changes to the real screen, so rows where
+  // the one shown differs from it have to be redrawn too
+  for (int i = 0; i < kRows_; ++i) {
+    if (pixel_buffer_[i] != real.pixel_buffer_[i]) MarkDirty(i, i + 1);
+  }
+  int written_begin = kMemorySize_;
+  int written_end = 0;
+  for (int i = 0; i < kMemorySize_; ++i) {
+    if (memory_[i] != real.memory_[i]) {
+      written_begin = std::min(written_begin, i);
+      written_end = i + 1;
+    }
+  }
+  if (written_begin < written_end) {
+    InvalidateDecodeCache(written_begin, written_end - written_begin);
+  }
+  static_cast<Chip8State&>(*this) = real;
+  budget_carry_ = budget_carry;
+  compiled_stale_ = compiled_stale;
+  exit_on_unknown_ = exit_on_unknown;
+  unknown_opcode_ = unknown_opcode;
+
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+  run_ahead_timing_.frames += 1;
+  run_ahead_timing_.total += elapsed.count();
+  run_ahead_timing_.max = std::max(run_ahead_timing_.max, elapsed.count());
+}
+
 void Chip8::PlaySound() {
   if (sound_timer_ > 0) {
     sound_->Start(440);
@@ -709,6 +1586,10 @@ void Chip8::PlaySound() {
 }
 
 void Chip8::Paint() {
-  DrawPixelsToDisplayBuffer();
-  display_->Paint();
+  display_->Paint(pixel_buffer_, dirty_begin_, dirty_end_, input_time_);
+  if (dirty_begin_ < dirty_end_) {
+    input_time_ = std::chrono::steady_clock::time_point();
+  }
+  dirty_begin_ = kRows_;
+  dirty_end_ = 0;
 }
@@ -7,11 +7,18 @@
 #ifndef SRC_CHIP8_H_
 #define SRC_CHIP8_H_
 
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <vector>
 
-#include "src/keyboard.h"
-#include "src/sound.h"
-#include "src/display.h"
+#include "src/compiled.h"
+#include "src/frontend.h"
+#include "src/jit.h"
+#include "src/random.h"
+#include "src/rewind.h"
+#include "src/trace.h"
 
 #ifdef NDEBUG
 #  define DEBUG 0
@@ -20,45 +27,216 @@
 #endif
 
 
-class Chip8 {
+// Guest-visible machine state, as one cache-line-aligned, trivially copyable
+// block, so a copy of the machine is a single memcpy; the registers touched
+// by nearly every instruction are packed together at the front
+struct alignas(64) Chip8State {
+  static const int kMemorySize_ = 0x1000;  // RAM
+  static const int kRegistersSize_ = 16;  // Registers
+  static const int kStackSize_ = 16;  // Interpreter return stack
+  static const int kRows_ = 32;  // Rows of pixel buffer
+
+  // Registers
+  uint8_t v_[kRegistersSize_];
+  uint16_t pc_;
+  uint16_t index_;
+  uint8_t sp_;
+
+  // Timers
+  uint8_t delay_timer_, sound_timer_;
+
+  // Keys held, as of the last key event applied (bit k for key k)
+  uint16_t keys_;
+
+  // Source of Cxkk's random bytes
+  Xoshiro128 random_;
+
+  uint16_t stack_[kStackSize_];
+
+  // Each row of the pixel buffer is one word, column j at bit
+  // (kCols_ - 1 - j), so a sprite row is drawn with a rotate, an XOR and an
+  // AND for collision
+  uint64_t pixel_buffer_[kRows_];
+
+  uint8_t memory_[kMemorySize_];
+};
+
+class Chip8 : public Chip8State {
  public:
   Chip8();
+  Chip8(DisplayInterface* display,
+        SoundInterface* sound,
+        KeyboardInterface* keyboard);
   ~Chip8();
 
-  // Memory
-  static const int kMemorySize_;
-  uint8_t* memory_;
-  uint16_t index_;
+  // Instruction at address; pc_ can run off the end of memory_ (e.g. Bnnn),
+  // where this reads 0 (an unknown instruction)
+  uint16_t OpcodeAt(const int address) const {
+    return address < kMemorySize_ - 1
+      ? memory_[address] << 8 | memory_[address + 1] : 0;
+  }
 
-  // Registers
-  static const int kRegistersSize_, kStackSize_;
-  uint8_t* v_;
-  uint16_t* stack_;
-  uint8_t sp_;
-  uint16_t pc_;
+  // Byte at address as Dxyn, Fx33, Fx55 and Fx65 reach it through index_,
+  // which can point past the end of memory_ (Fx1E); as in Chip8Lockstep,
+  // reads there give 0 and writes are dropped
+  uint8_t ByteAt(const int address) const {
+    return address < kMemorySize_ ? memory_[address] : 0;
+  }
+  void SetByteAt(const int address, const uint8_t value) {
+    if (address < kMemorySize_) memory_[address] = value;
+  }
 
   // Instructions
+  enum Opcode : uint8_t {
+    kOp00E0, kOp00EE, kOp1nnn, kOp2nnn, kOp3xkk, kOp4xkk, kOp5xy0, kOp6xkk,
+    kOp7xkk, kOp8xy0, kOp8xy1, kOp8xy2, kOp8xy3, kOp8xy4, kOp8xy5, kOp8xy6,
+    kOp8xy7, kOp8xyE, kOp9xy0, kOpAnnn, kOpBnnn, kOpCxkk, kOpDxyn, kOpEx9E,
+    kOpExA1, kOpFx07, kOpFx0A, kOpFx15, kOpFx18, kOpFx1E, kOpFx29, kOpFx33,
+    kOpFx55, kOpFx65, kOpUnknown, kNumOps,
+
+    // Superinstructions: straight-line sequences run with one dispatch,
+    // chosen from `chip8_bench --profile`; decoded only by kFusedDispatch
+    kOpFx07_3xkk_1nnn = kNumOps, kOp3xkk_1nnn, kOp4xkk_1nnn, kOp6xkk_Ex9E,
+    kOp6xkk_ExA1, kOp6xkk_6xkk, kOp6xkk_8xy5, kOp7xkk_3xkk, kOp7xkk_6xkk,
+    kOp8xy5_4xkk, kOpAnnn_Dxyn, kOpAnnn_Fx1E, kOpFx1E_Dxyn, kOpFx1E_Fx65,
+    kNumDecodedOps,
+
+    kOpUndecoded = kNumDecodedOps  // Not an instruction; marks stale entries
+  };
+  typedef void (Chip8::*Instruction)(const uint16_t opcode);
+  static const int kNumOpcodes_;
+  static const Instruction kInstructions_[];  // Handler for each Opcode
+  static Opcode instruction_table_[];  // Opcode for each 16-bit opcode
+  static const bool kInstructionTableBuilt_;
+  static Opcode DecodeInstruction(const uint16_t opcode);
+  static bool BuildInstructionTable();
+
+  struct Superinstruction {
+    Opcode sequence[3];  // kNumOps-terminated if shorter
+    Opcode fused;
+  };
+  static const int kNumSuperinstructions_;
+  static const Superinstruction kSuperinstructions_[];
+  static const int kMaxFusedBytes_;  // Longest superinstruction
+  inline Opcode Fuse(const int address, const Opcode op);
+
+  // Pre-decoded instruction at each address of memory_; entries are decoded
+  // on first execution and invalidated when the bytes under them are written
+  // (Fx33, Fx55, LoadProgram) or under the rest of a superinstruction, which
+  // also drops any JIT code translated from them and marks compiled_ stale if
+  // they were compiled. Code that writes memory_ directly must call InvalidateDecodeCache
+  struct DecodedInstruction {
+    uint16_t opcode;
+    Opcode op;
+  };
+  DecodedInstruction* decode_cache_;
+  void InvalidateDecodeCache();
+  inline void InvalidateDecodeCache(const int address, const int count);
+
+  // Dispatch engine used by EmulateCycle: nested switch on the opcode
+  // fields (InterpretInstruction), one lookup in instruction_table_
+  // (DispatchInstruction), fetch and decode through decode_cache_, the same
+  // with superinstructions, x86-64 code for basic blocks (JitInstructions),
+  // or the ROM's ahead-of-time compiled program (CompiledInstructions)
+  enum Dispatch {
+    kSwitchDispatch, kTableDispatch, kCachedDispatch, kFusedDispatch,
+    kJitDispatch, kCompiledDispatch
+  };
+  Dispatch dispatch_;
+
+  // Created on first use of kJitDispatch
+  Jit* jit_;
+  void JitInstructions(const int count);
+
+  // Compiled program matching the loaded ROM, or NULL; once the ROM writes
+  // over its own compiled code the program is stale and the rest of the run
+  // is interpreted
+  const CompiledProgram* compiled_;
+  bool compiled_stale_;
+  void CompiledInstructions(const int count);
+
+  // An unknown instruction ends the program unless exit_on_unknown_ is
+  // false, e.g. for a host running many machines; then the first one is
+  // kept in unknown_opcode_ (-1 for none) and execution carries on past it
+  bool exit_on_unknown_;
+  int unknown_opcode_;
   inline void UnknownInstruction(const uint16_t opcode);
+  template <typename Trace>
   void InterpretInstruction(const uint16_t opcode);
+  template <typename Trace>
+  void InterpretInstructions(const int count);  // Fetch and interpret `count`
+  void DispatchInstruction(const uint16_t opcode);
+  template <bool kCached, bool kFused = false>
+  void DispatchInstructions(const int count);  // Fetch and dispatch `count`
+  inline Opcode Fetch(uint16_t* opcode);
+  template <bool kFused>
+  inline Opcode FetchDecoded(uint16_t* opcode);
+
+  template <typename Trace> inline void Op00E0(const uint16_t opcode);
+  template <typename Trace> inline void Op00EE(const uint16_t opcode);
+  template <typename Trace> inline void Op1nnn(const uint16_t opcode);
+  template <typename Trace> inline void Op2nnn(const uint16_t opcode);
+  template <typename Trace> inline void Op3xkk(const uint16_t opcode);
+  template <typename Trace> inline void Op4xkk(const uint16_t opcode);
+  template <typename Trace> inline void Op5xy0(const uint16_t opcode);
+  template <typename Trace> inline void Op6xkk(const uint16_t opcode);
+  template <typename Trace> inline void Op7xkk(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy0(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy1(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy2(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy3(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy4(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy5(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy6(const uint16_t opcode);
+  template <typename Trace> inline void Op8xy7(const uint16_t opcode);
+  template <typename Trace> inline void Op8xyE(const uint16_t opcode);
+  template <typename Trace> inline void Op9xy0(const uint16_t opcode);
+  template <typename Trace> inline void OpAnnn(const uint16_t opcode);
+  template <typename Trace> inline void OpBnnn(const uint16_t opcode);
+  template <typename Trace> inline void OpCxkk(const uint16_t opcode);
+  template <typename Trace> inline void OpDxyn(const uint16_t opcode);
+  template <typename Trace> inline void OpEx9E(const uint16_t opcode);
+  template <typename Trace> inline void OpExA1(const uint16_t opcode);
+  template <typename Trace> inline void OpFx07(const uint16_t opcode);
+  template <typename Trace> inline void OpFx0A(const uint16_t opcode);
+  template <typename Trace> inline void OpFx15(const uint16_t opcode);
+  template <typename Trace> inline void OpFx18(const uint16_t opcode);
+  template <typename Trace> inline void OpFx1E(const uint16_t opcode);
+  template <typename Trace> inline void OpFx29(const uint16_t opcode);
+  template <typename Trace> inline void OpFx33(const uint16_t opcode);
+  template <typename Trace> inline void OpFx55(const uint16_t opcode);
+  template <typename Trace> inline void OpFx65(const uint16_t opcode);
+  void OpUnknown(const uint16_t opcode);
 
-  // Keyboard
-  Keyboard* keyboard_;
+  // Keyboard; keys_ is refreshed from it at the start of each frame and at
+  // each key event applied within one
+  static const int kNumKeys_;
+  KeyboardInterface* keyboard_;
+  bool KeyIsPressed(const uint8_t key) const {
+    return key < kNumKeys_ && ((keys_ >> key) & 1);
+  }
 
   // Display
-  static const int kRows_, kCols_, kPixelSize_, kChannels_;
-  uint8_t** pixel_buffer_;
-  uint8_t* display_buffer_;
-  Display* display_;
+  static const int kCols_;
+  DisplayInterface* display_;
+
+  bool Pixel(const int i, const int j) const {
+    return (pixel_buffer_[i] >> (kCols_ - 1 - j)) & 1;
+  }
+
+  // Rows [dirty_begin_, dirty_end_) changed since the last Paint, so the
+  // display redraws and uploads only those (or nothing)
+  int dirty_begin_, dirty_end_;
+  void MarkDirty(const int begin, const int end) {
+    dirty_begin_ = begin < dirty_begin_ ? begin : dirty_begin_;
+    dirty_end_ = end > dirty_end_ ? end : dirty_end_;
+  }
 
-  bool TogglePixel(int i, int j);
   void ClearPixelBuffer();
-  void ClearDisplayBuffer();
-  void DrawPixelToDisplayBuffer(const int& i, const int& j);
   bool DrawSpriteToPixelBuffer(
     const uint8_t& vx,
     const uint8_t& vy,
     const uint8_t& n);
-  void DrawPixelsToDisplayBuffer();
 
   static const int kFontSpritesAddress_;
   static const int kBytesPerFontSprite_;
@@ -67,53 +245,153 @@ class Chip8 {
   void LoadFontSprites();
   static const int kFramesPerSecond_;
   static const double kSecondsPerFrame_;
-  static clock_t then_;
 
-  // Timers
-  uint8_t delay_timer_, sound_timer_;
+  // Frame pacing: Step sleeps until each frame's deadline, a fixed period
+  // after the last one's rather than after the frame actually ran, so
+  // pacing doesn't drift. After a hitch it runs late frames back to back to
+  // catch up, unless it fell more than kMaxCatchUpFrames_ behind, in which
+  // case it drops them and paces from now
+  static const int kMaxCatchUpFrames_;
+  std::chrono::steady_clock::time_point next_frame_;
+  struct FrameTiming {
+    int frames, caught_up, dropped;
+    double late_total, late_squares, late_max;  // Seconds past the deadline
+  };
+  FrameTiming frame_timing_;
+
+  // Step runs each frame at its deadline for the period just before it,
+  // from frame_begin_; EmulateCycle applies a timestamped key event at the
+  // instruction that falls at the same point of the frame, so input lands
+  // within one instruction's time of its stamp (which is only as fine as
+  // the display's refresh; see Keyboard), in order, and taps shorter than a
+  // frame aren't lost. input_time_ is the earliest applied
+  // event no changed frame has answered yet, for measuring latency
+  std::chrono::steady_clock::time_point frame_begin_;
+  std::chrono::steady_clock::time_point input_time_;
+  void RunInstructions(const int budget);  // Skipping idle loops
 
   // Sound
-  Sound* sound_;
+  SoundInterface* sound_;
 
   // Program
   static const int kProgramAddress_;
   static const int kMaxProgramSize_;
+  int program_size_;  // Bytes of the loaded ROM
 
   void LoadProgram(const std::string& path_to_rom);
   static void LoadProgram(const std::string& path_to_rom,
                           unsigned char* buffer);
   void Run(const std::string& path_to_rom);
-  void Step();
-  void EmulateCycle();
+  void Step();  // Emulate a frame at its deadline
+  void EmulateCycle();  // EmulateFrame, then sound and the screen
+  void EmulateFrame();
+  void ExecuteInstructions(const int count);  // With the dispatch_ engine
   void UpdateTimers();
+
+  // FNV-1a hashes of the guest-visible machine state (memory, registers,
+  // stack, timers and screen) and of the screen alone, e.g. to compare runs
+  uint64_t StateHash() const;
+  uint64_t ScreenHash() const;
+
+  // Snapshots: the guest-visible state plus the configuration that decides
+  // what the machine does next, as a versioned binary image (kStateMagic_,
+  // kStateVersion_, then the fields in a fixed order, little-endian) of
+  // about 4.4 KB. SaveState reuses the image's storage, so taking one every
+  // frame costs microseconds. LoadState returns false, leaving the machine
+  // as it was, if the image isn't one this version can read or holds values
+  // out of range (index_ past memory_, program_size_ over
+  // kMaxProgramSize_, a speed that isn't a positive number)
+  static const char kStateMagic_[];
+  static const uint16_t kStateVersion_;
+  void SaveState(std::vector<uint8_t>* image) const;
+  bool LoadState(const std::vector<uint8_t>& image);
+  bool SaveStateFile(const std::string& path) const;
+  bool LoadStateFile(const std::string& path);
+
+  // Save and load hotkeys, to state_path_ (the ROM's path + ".state"), run
+  // by the emulation thread between frames
+  std::string state_path_;
+  void RunCommands();
+
+  // Rewind: with rewind_ set (it's NULL by default; Chip8 owns it), Step
+  // records the state at the start of every frame, and while the host holds
+  // the rewind key restores the previous one instead of emulating, stepping
+  // back a frame per frame
+  Rewind* rewind_;
+  std::vector<uint8_t> snapshot_;  // Scratch
+  void AdvanceFrame();
+
+  // Run-ahead: with run_ahead_ frames (0, the default, is off), each frame
+  // runs for real, sets the sound, then copies the machine, runs
+  // run_ahead_ more frames holding the keys as they are now, and shows that
+  // screen before putting the copy back, so what's shown answers input
+  // run_ahead_ frames sooner. The state is a plain block, so the copy is a
+  // few KB and the decode cache is invalidated only where the speculative
+  // frames left memory different
+  static const int kMaxRunAhead_;
+  int run_ahead_;
+  void RunAhead();
+  struct RunAheadTiming {
+    int frames;
+    double total, max;  // Seconds spent on speculative frames
+  };
+  RunAheadTiming run_ahead_timing_;
+
+  // Idle loops: code that spins without changing state until the next timer
+  // tick or input event, i.e. a jump to itself, a delay timer poll
+  // (Fx07; 3xkk or 4xkk; 1nnn back to the Fx07) that keeps looping, or Fx0A
+  // with no key pressed. Keys change only between the runs of instructions
+  // that EmulateCycle splits a frame into at key events, so RunInstructions
+  // can drop whole trips around the loop from a run and execute only the
+  // remainder, leaving the same state as running them all
+  static const int kIdleCheckInterval_;  // Instructions between checks
+  bool skip_idle_loops_;
+  int IdleLoopLength();  // Instructions per trip if pc_ is in one, else 0
   void PlaySound();
   void Paint();
 
-  // Configuration
-  uint16_t speed_;
+  // Configuration; instructions_per_second_ is spread over the frames by
+  // FrameBudget, which gives each frame the whole part of its share plus the
+  // fraction earlier frames carried over, so frames differ by at most one
+  // instruction and the rate averages out exactly. Unless paced_, Step runs
+  // frames back to back, as fast as possible
+  static const double kDefaultInstructionsPerSecond_;
+  double instructions_per_second_;
+  double budget_carry_;
+  int FrameBudget();
+  int64_t instructions_;  // Run (or skipped as idle) over all frames
+  bool paced_;
   bool wrap_around_y_;
-  uint8_t foreground_red_pixel_value_,
-    foreground_green_pixel_value_,
-    foreground_blue_pixel_value_;
-  uint8_t background_red_pixel_value_,
-    background_green_pixel_value_,
-    background_blue_pixel_value_;
-
-  // Debugging
-  template <typename _ = void, typename... Args>
+
+  // random_ starts from kDefaultSeed_, so a run is a function of the ROM,
+  // the configuration and the keys alone (timers and instruction budgets
+  // count emulated frames, never host time) unless the host seeds it
+  static const uint64_t kDefaultSeed_;
+
+  // Debugging; with tracing, instructions run through
+  // InterpretInstruction<PrintTrace> or <StepTrace> whatever dispatch_ is,
+  // and otherwise no tracing code runs. Defaults to stepping in DEBUG builds
+  enum Tracing { kNoTracing, kPrintTracing, kStepTracing };
+  Tracing tracing_;
+
+  template <typename Trace>
+  inline void DebugState(const uint16_t opcode);
+
+  template <typename Trace, typename... Args>
   inline void DebugMessage(const char* message, Args... args) {
-    if (DEBUG) std::fprintf(stderr, message, args...);
+    if (Trace::kEnabled) std::fprintf(stderr, message, args...);
     return;
   }
 
-  template <typename _ = void>
+  template <typename Trace>
   inline void DebugMessage(const char* message) {
-    if (DEBUG) std::fprintf(stderr, "%s", message);
+    if (Trace::kEnabled) std::fprintf(stderr, "%s", message);
     return;
   }
 
+  template <typename Trace>
   inline void DebugScreen() {
-    if (DEBUG) {
+    if (Trace::kEnabled) {
       std::fprintf(stderr, "\n    ");  // Indent
       for (int j = 0; j < (kCols_ - 6)/2; ++j) std::fprintf(stderr, " ");
       std::fprintf(stderr, "SCREEN");
@@ -123,7 +401,7 @@ class Chip8 {
         std::fprintf(stderr, "    ");  // Indent
         for (int j = 0; j < kCols_; ++j) {
           std::fprintf(stderr, "%s",
-                       pixel_buffer_[i][j] == 1 ? "\u25A0" : "\u25A1");
+                       Pixel(i, j) ? "\u25A0" : "\u25A1");
         }
         std::fprintf(stderr, "\n");
       }
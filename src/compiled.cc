@@ -0,0 +1,44 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include "src/compiled.h"
+
+#include <cstring>
+#include <vector>
+
+#include "src/chip8.h"
+
+
+// Function-local so that generated programs can register themselves from
+// their own static initializers, in any order
+static std::vector<const CompiledProgram*>& Registry() {
+  static std::vector<const CompiledProgram*> registry;
+  return registry;
+}
+
+CompiledProgram::CompiledProgram(const char* name,
+                                 const uint8_t* rom,
+                                 const int rom_size,
+                                 const uint8_t* code)
+  : name_(name), rom_(rom), rom_size_(rom_size), code_(code) {
+  Registry().push_back(this);
+}
+
+bool CompiledProgram::IsCode(const int address) const {
+  const int i = address - Chip8::kProgramAddress_;
+  return 0 <= i && i < rom_size_ && code_[i];
+}
+
+const CompiledProgram* CompiledProgram::Find(const uint8_t* rom,
+                                             const int rom_size) {
+  for (const CompiledProgram* program : Registry()) {
+    if (program->rom_size_ == rom_size
+      && !std::memcmp(program->rom_, rom, rom_size)) {
+      return program;
+    }
+  }
+  return NULL;
+}
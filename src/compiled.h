@@ -0,0 +1,45 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_COMPILED_H_
+#define SRC_COMPILED_H_
+
+#include <cstdint>
+
+class Chip8;
+
+
+// A ROM compiled ahead of time to C++ by chip8_aot. Each generated
+// translation unit defines one CompiledProgram and registers it at static
+// initialization; Chip8::LoadProgram picks the one whose bytes match the ROM
+class CompiledProgram {
+ public:
+  // rom and code are rom_size bytes; code[i] is nonzero if byte i of the ROM
+  // is part of an instruction that was compiled
+  CompiledProgram(const char* name, const uint8_t* rom, const int rom_size,
+                  const uint8_t* code);
+  virtual ~CompiledProgram() {}
+
+  // Run at most `count` instructions starting at chip8->pc_; returns how
+  // many ran. Stops early, with pc_ at the next instruction, where pc_ isn't
+  // the start of a compiled block or the next block doesn't fit in `count`
+  virtual int Run(Chip8* chip8, const int count) const = 0;
+
+  // Whether a write at address (of memory) changes compiled code
+  bool IsCode(const int address) const;
+
+  const char* name_;
+
+  // Program registered for this ROM, or NULL
+  static const CompiledProgram* Find(const uint8_t* rom, const int rom_size);
+
+ private:
+  const uint8_t* rom_;
+  const int rom_size_;
+  const uint8_t* code_;
+};
+
+#endif  // SRC_COMPILED_H_
@@ -9,18 +9,42 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <vector>
 
 #include "src/keyboard.h"
 
 
-Display::Display(const int display_rows,
-                 const int display_cols,
-                 uint8_t* display_buffer,
+const int Display::kPixelSize_ = 15;  // Initial size of pixel in window
+const int Display::kNumUploadBuffers_ = 3;
+const GLuint64 Display::kUploadTimeout_ = 1000000000;
+const double Display::kIdleTimeout_ = 0.25;
+
+Display::Display(const int rows,
+                 const int cols,
                  Keyboard* keyboard)
-  : display_rows_(display_rows),
-    display_cols_(display_cols),
+  : rows_(rows),
+    cols_(cols),
+    display_rows_(rows*kPixelSize_),
+    display_cols_(cols*kPixelSize_),
+    frames_(Frame{std::vector<uint64_t>(rows, 0),
+                  std::chrono::steady_clock::time_point()}),
+    shown_(rows, 0),
+    answered_input_(0),
+    redraw_(true),
     keyboard_(keyboard) {
+  // Default colors
+  foreground_red_pixel_value_
+    = foreground_green_pixel_value_
+    = foreground_blue_pixel_value_
+    = 255;
+  background_red_pixel_value_
+    = background_green_pixel_value_
+    = background_blue_pixel_value_
+    = 0;
+
   // Initialize GLFW
   glewExperimental = true;  // Needed for core profile
   if (!glfwInit()) {
@@ -48,8 +72,8 @@ Display::Display(const int display_rows,
 
   // Open a window and initialize its OpenGL context
   window_ = glfwCreateWindow(
-    display_cols,
-    display_rows,
+    display_cols_,
+    display_rows_,
     "Chip8-Emu",
     NULL,
     NULL);
@@ -60,11 +84,15 @@ Display::Display(const int display_rows,
   }
   glfwMakeContextCurrent(window_);
 
-  // Keyboard input
-  glfwSetKeyCallback(window_, keyboard_->QueryInput);
+  // Refresh waits for the vertical blank rather than spinning
+  glfwSwapInterval(1);
 
-  // Resizing
+  // Keyboard input, and resizing and exposure, which must redraw even if no
+  // frame changed; the callbacks find this Display by the user pointer
+  glfwSetWindowUserPointer(window_, this);
+  glfwSetKeyCallback(window_, KeyCallback);
   glfwSetFramebufferSizeCallback(window_, FramebufferSizeCallback);
+  glfwSetWindowRefreshCallback(window_, WindowRefreshCallback);
 
   // Allows GLEW to access modern OpenGL extensions, set
   // to true for OpenGL contexts version 3.2 and above
@@ -148,11 +176,45 @@ Display::Display(const int display_rows,
   glBindTexture(GL_TEXTURE_2D, tex_);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  // Allocate the texture once; Refresh uploads the rows that change
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  const std::vector<uint8_t> blank(rows_*cols_, 0);
+  if (GLEW_ARB_texture_storage) {
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, cols_, rows_);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cols_, rows_,
+                    GL_RED, GL_UNSIGNED_BYTE, &blank[0]);
+  } else {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, cols_, rows_,
+                 0, GL_RED, GL_UNSIGNED_BYTE, &blank[0]);
+  }
 
-  // Save the display buffer
-  display_buffer_ = display_buffer;
+  // Ring of upload buffers
+  persistent_ = GLEW_ARB_buffer_storage;
+  upload_buffers_ = new GLuint[kNumUploadBuffers_];
+  upload_mappings_ = new uint8_t*[kNumUploadBuffers_]();
+  upload_fences_ = new GLsync[kNumUploadBuffers_]();
+  next_upload_buffer_ = 0;
+  glGenBuffers(kNumUploadBuffers_, upload_buffers_);
+  for (int k = 0; k < kNumUploadBuffers_; ++k) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers_[k]);
+    if (persistent_) {
+      const GLbitfield flags
+        = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, rows_*cols_, NULL, flags);
+      upload_mappings_[k] = static_cast<uint8_t*>(
+        glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, rows_*cols_, flags));
+    } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, rows_*cols_, NULL, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  upload_timing_.uploads = 0;
+  upload_timing_.last = upload_timing_.total = upload_timing_.max = 0.;
+  input_latency_.responses = 0;
+  input_latency_.total = input_latency_.max = 0.;
 
   // Allow to capture escape key press event
   glfwSetInputMode(window_, GLFW_STICKY_KEYS, GL_TRUE);
@@ -163,41 +225,173 @@ Display::~Display() {
   glDeleteVertexArrays(1, &vao_);
   glDeleteBuffers(1, &vbo_);
   glDeleteBuffers(1, &ebo_);
+  glDeleteTextures(1, &tex_);
+  for (int k = 0; k < kNumUploadBuffers_; ++k) {
+    if (upload_fences_[k]) glDeleteSync(upload_fences_[k]);
+    if (upload_mappings_[k]) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers_[k]);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(kNumUploadBuffers_, upload_buffers_);
+  delete[] upload_buffers_;
+  delete[] upload_mappings_;
+  delete[] upload_fences_;
   delete shader_;
 
   glfwTerminate();
 }
 
-void Display::Paint() {
+void Display::Upload(const uint64_t* pixel_buffer,
+                     const int begin, const int end) {
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+
+  // Wait until the GPU has copied out of this buffer; with a ring of them
+  // this is normally long done
+  const int k = next_upload_buffer_;
+  next_upload_buffer_ = (k + 1)%kNumUploadBuffers_;
+  if (upload_fences_[k]) {
+    glClientWaitSync(upload_fences_[k], GL_SYNC_FLUSH_COMMANDS_BIT,
+                     kUploadTimeout_);
+    glDeleteSync(upload_fences_[k]);
+    upload_fences_[k] = NULL;
+  }
+
+  const GLintptr offset = begin*cols_;
+  const GLsizeiptr size = (end - begin)*cols_;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers_[k]);
+  uint8_t* texels = persistent_
+    ? upload_mappings_[k] + offset
+    : static_cast<uint8_t*>(glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, offset, size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+        | GL_MAP_UNSYNCHRONIZED_BIT));
+  if (!texels) {
+    std::fprintf(stderr, "Failed to map texture upload buffer.\n");
+    std::exit(EXIT_FAILURE);
+  }
+  for (int i = begin; i < end; ++i) {
+    for (int j = 0; j < cols_; ++j) {
+      texels[(i - begin)*cols_ + j]
+        = ((pixel_buffer[i] >> (cols_ - 1 - j)) & 1) ? 255 : 0;
+    }
+  }
+  if (!persistent_) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  // Queue the copy from the buffer into the texture
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, begin, cols_, end - begin,
+                  GL_RED, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(offset));
+  upload_fences_[k] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+  upload_timing_.uploads += 1;
+  upload_timing_.last = elapsed.count();
+  upload_timing_.total += elapsed.count();
+  if (elapsed.count() > upload_timing_.max) {
+    upload_timing_.max = elapsed.count();
+  }
+}
+
+void Display::Paint(const uint64_t* pixel_buffer,
+                    const int dirty_begin, const int dirty_end,
+                    const std::chrono::steady_clock::time_point input_time) {
+  const std::chrono::steady_clock::time_point none;
+  if (unanswered_input_ != none
+   && unanswered_input_.time_since_epoch().count()
+      == answered_input_.load(std::memory_order_acquire)) {
+    unanswered_input_ = none;
+  }
+  if (unanswered_input_ == none) unanswered_input_ = input_time;
+
+  // Publish the frame only if it changed
+  if (dirty_begin >= dirty_end) return;
+  Frame* frame = frames_.Back();
+  std::copy(pixel_buffer, pixel_buffer + rows_, frame->rows.begin());
+  frame->input_time = unanswered_input_;
+  frames_.Publish();
+  glfwPostEmptyEvent();  // Wake Refresh if it's waiting
+}
+
+void Display::Refresh() {
+  // Upload the rows of the latest frame that differ from the one shown
+  glBindTexture(GL_TEXTURE_2D, tex_);
+  std::chrono::steady_clock::time_point input_time;
+  if (frames_.Acquire()) {
+    const std::vector<uint64_t>& frame = frames_.Front().rows;
+    int begin = 0, end = rows_;
+    while (begin < end && frame[begin] == shown_[begin]) ++begin;
+    while (end > begin && frame[end - 1] == shown_[end - 1]) --end;
+    if (begin < end) {
+      Upload(&frame[0], begin, end);
+      std::copy(frame.begin() + begin, frame.begin() + end,
+                shown_.begin() + begin);
+      input_time = frames_.Front().input_time;
+      redraw_ = true;
+    }
+  }
+
+  // Nothing to show; sleep until there may be
+  if (!redraw_) {
+    glfwWaitEventsTimeout(kIdleTimeout_);
+    return;
+  }
+  redraw_ = false;
+
   // Clear the screen, can cause flickering (?)
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT);
 
-  // Paint
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-               display_cols_, display_rows_,
-               0, GL_RGB, GL_UNSIGNED_BYTE, display_buffer_);
-  glBindTexture(GL_TEXTURE_2D, tex_);
-
-  // Use custom shader
+  // Use custom shader, which scales up the texture and colors it
   shader_->Use();
+  shader_->SetColors(
+    foreground_red_pixel_value_, foreground_green_pixel_value_,
+    foreground_blue_pixel_value_,
+    background_red_pixel_value_, background_green_pixel_value_,
+    background_blue_pixel_value_);
 
   glBindVertexArray(vao_);
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
   // Swap buffers
   glfwSwapBuffers(window_);
+  if (input_time != std::chrono::steady_clock::time_point()
+   && input_time.time_since_epoch().count()
+      != answered_input_.load(std::memory_order_relaxed)) {
+    std::chrono::duration<double> latency
+      = std::chrono::steady_clock::now() - input_time;
+    input_latency_.responses += 1;
+    input_latency_.total += latency.count();
+    if (latency.count() > input_latency_.max) {
+      input_latency_.max = latency.count();
+    }
+    answered_input_.store(input_time.time_since_epoch().count(),
+                          std::memory_order_release);
+  }
+  // Key events that arrived during the swap are delivered, and stamped, only
+  // now
   glfwPollEvents();
 }
 
 void Display::FramebufferSizeCallback(GLFWwindow* window,
                                       const GLsizei display_rows,
                                       const GLsizei display_cols) {
-  // Unused
-  static_cast<void>(window);
-
   // Callback to make viewport match window size; may be changed by user or OS
   glViewport(0, 0, display_rows, display_cols);
+  static_cast<Display*>(glfwGetWindowUserPointer(window))->redraw_ = true;
+}
+
+void Display::WindowRefreshCallback(GLFWwindow* window) {
+  static_cast<Display*>(glfwGetWindowUserPointer(window))->redraw_ = true;
+}
+
+void Display::KeyCallback(GLFWwindow* window, int key, int scancode,
+                          int action, int mods) {
+  static_cast<Display*>(glfwGetWindowUserPointer(window))
+    ->keyboard_->QueryInput(window, key, scancode, action, mods);
 }
 
 bool Display::ShouldClose() {
@@ -10,22 +10,98 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "src/frontend.h"
 #include "src/keyboard.h"
 #include "src/shader.h"
+#include "src/triple_buffer.h"
 
 
-class Display {
+class Display : public DisplayInterface {
  public:
   Display(
-    const int display_rows,
-    const int display_cols,
-    uint8_t* display_buffer,
+    const int rows,
+    const int cols,
     Keyboard* keyboard);
   ~Display();
 
+  // Pixel buffer is (rows_ x cols_), uploaded as a single-channel texture
+  // of the same size (0 or 255 per pixel) and scaled up and colored by the
+  // shader; the window opens at kPixelSize_ window pixels per pixel and may
+  // be resized
+  static const int kPixelSize_;
+  const int rows_;
+  const int cols_;
   const int display_rows_;
   const int display_cols_;
-  uint8_t* display_buffer_;
+
+  uint8_t foreground_red_pixel_value_,
+    foreground_green_pixel_value_,
+    foreground_blue_pixel_value_;
+  uint8_t background_red_pixel_value_,
+    background_green_pixel_value_,
+    background_blue_pixel_value_;
+
+  // Uploads stream through a ring of pixel buffer objects into texture
+  // storage allocated once (immutable with ARB_texture_storage), so that
+  // glTexSubImage2D only queues the copy and it overlaps emulating the next
+  // frame. Buffers stay mapped with ARB_buffer_storage, and are otherwise
+  // mapped per upload; a fence per buffer keeps the CPU from writing one
+  // that the GPU may still be reading
+  static const int kNumUploadBuffers_;
+  static const GLuint64 kUploadTimeout_;  // Nanoseconds
+  bool persistent_;
+  GLuint* upload_buffers_;
+  uint8_t** upload_mappings_;  // Persistently mapped, or NULL
+  GLsync* upload_fences_;
+  int next_upload_buffer_;
+
+  // Unpack rows [begin, end) of the pixel buffer (0 or 255 per pixel) into
+  // the next upload buffer and copy them into the texture
+  void Upload(const uint64_t* pixel_buffer, const int begin, const int end);
+
+  // CPU time spent in Upload, in seconds, to check that it doesn't stall
+  struct UploadTiming {
+    int uploads;
+    double last, total, max;
+  };
+  UploadTiming upload_timing_;
+
+  // Frames go from the emulation thread (Paint) to the thread that created
+  // the display (Refresh) without either waiting on the other; Refresh
+  // uploads the rows that differ from the frame it showed last, so frames it
+  // skips lose nothing
+  struct Frame {
+    std::vector<uint64_t> rows;
+    std::chrono::steady_clock::time_point input_time;  // See Paint
+  };
+  TripleBuffer<Frame> frames_;
+  std::vector<uint64_t> shown_;  // Rows in the texture
+
+  // Input latency, from a key event's stamp (when it was polled, up to a
+  // refresh after the key; see Keyboard) to the swap that first shows a
+  // frame differing from the last one shown after it. A frame that answers an
+  // event is tagged with its time; Paint keeps tagging the frames it
+  // publishes with the earliest unanswered time (unanswered_input_) until
+  // Refresh reports showing it (answered_input_), since frames that Refresh
+  // skips, or that change nothing, don't count
+  std::chrono::steady_clock::time_point unanswered_input_;
+  std::atomic<std::chrono::steady_clock::rep> answered_input_;
+  struct InputLatency {
+    int responses;
+    double total, max;  // Seconds
+  };
+  InputLatency input_latency_;
+
+  // While no frame changes the screen, e.g. on a title screen waiting at
+  // Fx0A, Refresh neither draws nor swaps: it sleeps in glfwWaitEvents until
+  // Paint wakes it with a new frame, an event arrives (redraw_ set by the
+  // resize and refresh callbacks) or kIdleTimeout_ seconds pass
+  static const double kIdleTimeout_;
+  bool redraw_;
 
   GLFWwindow* window_;
 
@@ -36,13 +112,23 @@ class Display {
 
   Shader* shader_;
 
-  void Paint();
+  void Paint(const uint64_t* pixel_buffer,
+             const int dirty_begin, const int dirty_end,
+             const std::chrono::steady_clock::time_point input_time);
+  void Refresh();
   bool ShouldClose();
 
   static void FramebufferSizeCallback(
     GLFWwindow* window,
     const int rows,
     const int cols);
+  static void WindowRefreshCallback(GLFWwindow* window);
+  static void KeyCallback(
+    GLFWwindow* window,
+    int key,
+    int scancode,
+    int action,
+    int mods);
 
   Keyboard* keyboard_;
 };
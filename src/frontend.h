@@ -0,0 +1,103 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_FRONTEND_H_
+#define SRC_FRONTEND_H_
+
+#include <chrono>
+#include <cstdint>
+
+
+// Interfaces between the emulation core and the host; the core talks to the
+// display, sound and keyboard only through these, so it can run without a
+// window, an OpenGL context or an audio device
+class DisplayInterface {
+ public:
+  virtual ~DisplayInterface() {}
+
+  // Hand over a finished frame of the pixel buffer, one word per row with
+  // the leftmost column in the top bit, of which only rows
+  // [dirty_begin, dirty_end) changed since the last Paint. input_time is
+  // when the earliest key event not yet answered by a changed frame
+  // happened, or time_point() for none, to measure input latency. Chip8::Run
+  // calls this from its emulation thread, so it must not block on the host
+  virtual void Paint(const uint64_t* pixel_buffer,
+                     const int dirty_begin, const int dirty_end,
+                     const std::chrono::steady_clock::time_point input_time)
+    = 0;
+
+  // Show the latest frame and poll host events, on the thread that created
+  // the display; Chip8::Run loops on this until ShouldClose. With nothing
+  // new to show it may block until a frame is painted or an event arrives
+  virtual void Refresh() = 0;
+  virtual bool ShouldClose() = 0;
+};
+
+class SoundInterface {
+ public:
+  virtual ~SoundInterface() {}
+
+  virtual void Start(const unsigned int hz) = 0;
+  virtual void Stop() = 0;
+};
+
+class KeyboardInterface {
+ public:
+  virtual ~KeyboardInterface() {}
+
+  // Bit k set while key k of the hex keypad is held
+  virtual uint16_t PressedKeys() = 0;
+
+  // Keyboards that queue key changes with the host time they happened let
+  // the emulator apply each at the matching instruction: the time of the
+  // next queued change, if any, and applying it to PressedKeys
+  virtual bool NextKeyEvent(std::chrono::steady_clock::time_point* time) {
+    static_cast<void>(time);
+    return false;
+  }
+  virtual void ApplyKeyEvent() { }
+
+  // Commands from the host, e.g. hotkeys, that Chip8::Step carries out
+  // between frames; each one given is returned once, except that those that
+  // last while a key is held (kRewind) are polled with CommandHeld
+  enum Command { kNoCommand, kSaveState, kLoadState, kRewind };
+  virtual Command TakeCommand() { return kNoCommand; }
+  virtual bool CommandHeld(const Command command) {
+    static_cast<void>(command);
+    return false;
+  }
+  bool KeyIsPressed(uint8_t key) {
+    return key < 16 && ((PressedKeys() >> key) & 1);
+  }
+};
+
+// Null frontends, for headless emulation
+class NullDisplay : public DisplayInterface {
+ public:
+  void Paint(const uint64_t* pixel_buffer,
+             const int dirty_begin, const int dirty_end,
+             const std::chrono::steady_clock::time_point input_time) {
+    static_cast<void>(pixel_buffer);
+    static_cast<void>(dirty_begin);
+    static_cast<void>(dirty_end);
+    static_cast<void>(input_time);
+  }
+  void Refresh() { }
+  bool ShouldClose() { return false; }
+};
+
+class NullSound : public SoundInterface {
+ public:
+  void Start(const unsigned int hz) { static_cast<void>(hz); }
+  void Stop() { }
+};
+
+class NullKeyboard : public KeyboardInterface {
+ public:
+  uint16_t PressedKeys() { return 0; }
+};
+
+#endif  // SRC_FRONTEND_H_
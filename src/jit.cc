@@ -0,0 +1,479 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include "src/jit.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#if CHIP8_JIT
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+
+const int Jit::kMaxBlockLength_ = 16;
+const Jit::Block Jit::kEmptyBlock_ = {0, NULL};
+const int Jit::kCodeSize_ = 1 << 20;
+
+Jit::Jit(const int memory_size) : memory_size_(memory_size) {
+  blocks_ = new Block[memory_size_];
+  translated_ = new bool[memory_size_];
+  code_ = NULL;
+  code_used_ = 0;
+  page_size_ = 1;
+
+#if CHIP8_JIT
+  page_size_ = static_cast<int>(sysconf(_SC_PAGESIZE));
+  void* code = mmap(NULL, kCodeSize_, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    std::fprintf(stderr, "In Jit::Jit: failed to map code buffer; "
+                 "interpreting instead.\n");
+  } else {
+    code_ = static_cast<uint8_t*>(code);
+  }
+#endif
+
+  Flush();
+}
+
+Jit::~Jit() {
+#if CHIP8_JIT
+  if (code_) munmap(code_, kCodeSize_);
+#endif
+  delete[] blocks_;
+  delete[] translated_;
+}
+
+void Jit::Flush() {
+  for (int i = 0; i < memory_size_; ++i) {
+    blocks_[i].length = -1;
+    blocks_[i].code = NULL;
+    translated_[i] = false;
+  }
+  code_used_ = 0;
+}
+
+void Jit::Invalidate(const int address, const int count) {
+  for (int i = address; i < address + count; ++i) {
+    if (0 <= i && i < memory_size_ && translated_[i]) {
+      Flush();
+      return;
+    }
+  }
+}
+
+#if CHIP8_JIT
+
+// Host registers, numbered as in the x86-64 ModRM encoding
+enum HostRegister {
+  kEax = 0, kEcx = 1, kEdx = 2, kEbx = 3, kEsp = 4, kEbp = 5, kEsi = 6,
+  kEdi = 7, kR8 = 8, kR9 = 9, kR10 = 10, kR11 = 11, kR12 = 12, kR13 = 13,
+  kR14 = 14, kR15 = 15
+};
+
+// Arguments arrive in rdi (v), rsi (index), rdx (delay timer), rcx (sound
+// timer) and r8d (budget); r10d holds index_ and eax, r11d are scratch.
+// Guest V registers are pinned in the rest
+static const HostRegister kBudget = kR8, kIndex = kR10, kScratch = kR11;
+static const HostRegister kPinnable[] = {
+  kR9, kEbx, kEbp, kR12, kR13, kR14, kR15
+};
+static const int kNumPinnable = sizeof(kPinnable)/sizeof(kPinnable[0]);
+
+static bool IsCalleeSaved(const HostRegister r) {
+  return r == kEbx || r == kEbp || r >= kR12;
+}
+
+// Minimal emitter for the 32-bit register forms used by the translator
+class X86Emitter {
+ public:
+  explicit X86Emitter(uint8_t* code) : code_(code), size_(0) {}
+
+  int size() const { return size_; }
+
+  // Register-register ALU op: `op dst, src` (01 add, 09 or, 21 and, 29 sub,
+  // 31 xor, 39 cmp, 89 mov)
+  void AluRegReg(const uint8_t op, const HostRegister dst,
+                 const HostRegister src) {
+    Rex(false, src, dst);
+    Byte(op);
+    ModRm(3, src, dst);
+  }
+
+  // `op dst, imm32` with ModRM digit (0 add, 1 or, 4 and, 5 sub, 6 xor,
+  // 7 cmp)
+  void AluRegImm(const uint8_t digit, const HostRegister dst,
+                 const uint32_t imm) {
+    Rex(false, 0, dst);
+    Byte(0x81);
+    ModRm(3, digit, dst);
+    Imm32(imm);
+  }
+
+  void MovRegReg(const HostRegister dst, const HostRegister src) {
+    AluRegReg(0x89, dst, src);
+  }
+
+  void MovRegImm(const HostRegister dst, const uint32_t imm) {
+    Rex(false, 0, dst);
+    Byte(0xB8 + (dst & 7));
+    Imm32(imm);
+  }
+
+  // Shift by imm8 (digit 4 shl, 5 shr)
+  void Shift(const uint8_t digit, const HostRegister dst, const uint8_t imm) {
+    Rex(false, 0, dst);
+    Byte(0xC1);
+    ModRm(3, digit, dst);
+    Byte(imm);
+  }
+
+  // imul dst, src, imm8
+  void ImulImm(const HostRegister dst, const HostRegister src,
+               const uint8_t imm) {
+    Rex(false, dst, src);
+    Byte(0x6B);
+    ModRm(3, dst, src);
+    Byte(imm);
+  }
+
+  // cmovcc dst, src (0x44 e, 0x45 ne)
+  void Cmov(const uint8_t cc, const HostRegister dst, const HostRegister src) {
+    Rex(false, dst, src);
+    Byte(0x0F);
+    Byte(cc);
+    ModRm(3, dst, src);
+  }
+
+  // movzx dst, byte [base + disp]
+  void LoadByte(const HostRegister dst, const HostRegister base,
+                const uint8_t disp) {
+    Rex(false, dst, base);
+    Byte(0x0F);
+    Byte(0xB6);
+    ModRm(1, dst, base);
+    Byte(disp);
+  }
+
+  // mov byte [base + disp], src; always with REX so 5 encodes bpl, not ch
+  void StoreByte(const HostRegister base, const uint8_t disp,
+                 const HostRegister src) {
+    Byte(0x40 | ((src >> 3) << 2) | (base >> 3));
+    Byte(0x88);
+    ModRm(1, src, base);
+    Byte(disp);
+  }
+
+  // movzx r10d, word [rsi]; mov word [rsi], r10w
+  void LoadIndex() {
+    Rex(false, kIndex, kEsi);
+    Byte(0x0F);
+    Byte(0xB7);
+    ModRm(0, kIndex, kEsi);
+  }
+  void StoreIndex() {
+    Byte(0x66);
+    Rex(false, kIndex, kEsi);
+    Byte(0x89);
+    ModRm(0, kIndex, kEsi);
+  }
+
+  // jcc rel32 (0x84 e, 0x85 ne) to a target patched later; returns where
+  // the displacement is
+  int Jcc(const uint8_t cc) {
+    Byte(0x0F);
+    Byte(cc);
+    Imm32(0);
+    return size_ - 4;
+  }
+
+  // Point the displacement at `at` to the current position
+  void PatchToHere(const int at) {
+    const uint32_t rel = size_ - (at + 4);
+    for (int i = 0; i < 4; ++i) code_[at + i] = (rel >> (8*i)) & 0xFF;
+  }
+
+  void Push(const HostRegister r) { Rex(false, 0, r); Byte(0x50 + (r & 7)); }
+  void Pop(const HostRegister r) { Rex(false, 0, r); Byte(0x58 + (r & 7)); }
+  void Ret() { Byte(0xC3); }
+
+ private:
+  uint8_t* code_;
+  int size_;
+
+  void Byte(const uint8_t b) { code_[size_++] = b; }
+
+  void Imm32(const uint32_t imm) {
+    for (int i = 0; i < 4; ++i) Byte((imm >> (8*i)) & 0xFF);
+  }
+
+  void Rex(const bool w, const int reg, const int rm) {
+    const uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) Byte(rex);
+  }
+
+  void ModRm(const int mod, const int reg, const int rm) {
+    Byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+  }
+};
+
+// Which guest registers an instruction reads or writes; false if the
+// instruction can't be translated
+static bool Operands(const uint16_t opcode, uint16_t* used, bool* uses_index) {
+  const int x = (opcode >> 8) & 0x000F;
+  const int y = (opcode >> 4) & 0x000F;
+  *used = 0;
+  *uses_index = false;
+  switch (opcode & 0xF000) {
+    case 0x1000: return true;
+    case 0x3000: case 0x4000: *used = 1 << x; return true;
+    case 0x5000: case 0x9000: *used = (1 << x) | (1 << y); return true;
+    case 0x6000: case 0x7000: *used = 1 << x; return true;
+    case 0x8000: {
+      switch (opcode & 0x000F) {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+          *used = (1 << x) | (1 << y);
+          return true;
+        case 0x4: case 0x5: case 0x7:
+          *used = (1 << x) | (1 << y) | (1 << 0xF);
+          return true;
+        case 0x6: case 0xE:
+          *used = (1 << x) | (1 << 0xF);
+          return true;
+        default: return false;
+      }
+    }
+    case 0xA000: *uses_index = true; return true;
+    case 0xF000: {
+      switch (opcode & 0x00FF) {
+        case 0x07: case 0x15: case 0x18: *used = 1 << x; return true;
+        case 0x1E: case 0x29: *used = 1 << x; *uses_index = true; return true;
+        default: return false;
+      }
+    }
+    default: return false;
+  }
+}
+
+void Jit::Compile(const uint16_t pc, const uint8_t* memory) {
+  Block& block = blocks_[pc];
+  block.length = 0;
+  block.code = NULL;
+  if (!code_) return;
+
+  // First pass: trace the block through jumps and not-taken skips, and
+  // collect the guest registers it uses
+  int addresses[kMaxBlockLength_];
+  uint16_t registers = 0;
+  bool uses_index = false;
+  int length = 0;
+  int address = pc;
+  while (length < kMaxBlockLength_ && address < memory_size_ - 1) {
+    const uint16_t opcode = memory[address] << 8 | memory[address + 1];
+    uint16_t used;
+    bool index;
+    if (!Operands(opcode, &used, &index)) break;
+
+    int count = 0;
+    for (uint16_t r = registers | used; r; r &= r - 1) ++count;
+    if (count > kNumPinnable) break;
+
+    registers |= used;
+    uses_index |= index;
+    addresses[length++] = address;
+    address = ((opcode & 0xF000) == 0x1000) ? (opcode & 0x0FFF) : address + 2;
+  }
+  if (length == 0) return;
+
+  // Worst case is well under 64 bytes per instruction plus prologue and
+  // epilogue
+  const int worst_case = 64*(length + 4);
+  if (code_used_ + worst_case > kCodeSize_) {
+    Flush();
+    block.length = 0;
+  }
+  // Make writable only the pages the block may be written to
+  const int first_page = code_used_/page_size_*page_size_;
+  const int end_page
+    = (code_used_ + worst_case + page_size_ - 1)/page_size_*page_size_;
+  uint8_t* const pages = code_ + first_page;
+  const size_t pages_size = std::min(end_page, kCodeSize_) - first_page;
+  if (mprotect(pages, pages_size, PROT_READ | PROT_WRITE) != 0) return;
+
+  // Pin the used guest registers
+  HostRegister pinned[16];
+  int num_pinned = 0;
+  for (int r = 0; r < 16; ++r) {
+    pinned[r] = (registers & (1 << r)) ? kPinnable[num_pinned++] : kEax;
+  }
+
+  X86Emitter e(code_ + code_used_);
+  for (int i = 0; i < num_pinned; ++i) {
+    if (IsCalleeSaved(kPinnable[i])) e.Push(kPinnable[i]);
+  }
+  for (int r = 0; r < 16; ++r) {
+    if (registers & (1 << r)) e.LoadByte(pinned[r], kEdi, r);
+  }
+  if (uses_index) e.LoadIndex();
+
+  // Second pass: translate. Exits return the next pc in the low 16 bits and
+  // the number of guest instructions executed in the high 16 bits
+  uint16_t written = 0;
+  bool index_written = false;
+  int side_exits[2*kMaxBlockLength_];
+  int num_side_exits = 0;
+  for (int i = 0; i < length; ++i) {
+    const int at = addresses[i];
+    if (i > 0) {
+      // Budget used up: leave before this instruction
+      e.AluRegImm(7, kBudget, i);
+      e.MovRegImm(kEax, i << 16 | at);
+      side_exits[num_side_exits++] = e.Jcc(0x84);
+    }
+    const uint16_t opcode = memory[at] << 8 | memory[at + 1];
+    const int x = (opcode >> 8) & 0x000F;
+    const int y = (opcode >> 4) & 0x000F;
+    const uint8_t kk = opcode & 0x00FF;
+    const uint16_t nnn = opcode & 0x0FFF;
+    const HostRegister vx = pinned[x], vy = pinned[y], vf = pinned[0xF];
+
+    switch (opcode & 0xF000) {
+      case 0x1000: break;  // 1nnn: JP addr; followed by the trace
+      case 0x3000: case 0x4000: {  // 3xkk: SE Vx, byte; 4xkk: SNE Vx, byte
+        // Skip taken leaves the block; not taken continues the trace
+        e.AluRegImm(7, vx, kk);
+        e.MovRegImm(kEax, (i + 1) << 16 | (at + 4));
+        side_exits[num_side_exits++]
+          = e.Jcc((opcode & 0xF000) == 0x3000 ? 0x84 : 0x85);
+        break;
+      }
+      case 0x5000: case 0x9000: {  // 5xy0: SE Vx, Vy; 9xy0: SNE Vx, Vy
+        e.AluRegReg(0x39, vx, vy);
+        e.MovRegImm(kEax, (i + 1) << 16 | (at + 4));
+        side_exits[num_side_exits++]
+          = e.Jcc((opcode & 0xF000) == 0x5000 ? 0x84 : 0x85);
+        break;
+      }
+      case 0x6000: e.MovRegImm(vx, kk); written |= 1 << x; break;
+      case 0x7000: {  // 7xkk: ADD Vx, byte
+        e.AluRegImm(0, vx, kk);
+        e.AluRegImm(4, vx, 0xFF);
+        written |= 1 << x;
+        break;
+      }
+      case 0x8000: {
+        switch (opcode & 0x000F) {
+          case 0x0: e.MovRegReg(vx, vy); break;  // 8xy0: LD Vx, Vy
+          case 0x1: e.AluRegReg(0x09, vx, vy); break;  // 8xy1: OR Vx, Vy
+          case 0x2: e.AluRegReg(0x21, vx, vy); break;  // 8xy2: AND Vx, Vy
+          case 0x3: e.AluRegReg(0x31, vx, vy); break;  // 8xy3: XOR Vx, Vy
+          case 0x4: {  // 8xy4: ADD Vx, Vy
+            e.MovRegReg(kEax, vx);
+            e.AluRegReg(0x01, kEax, vy);
+            e.MovRegReg(kScratch, kEax);
+            e.Shift(5, kScratch, 8);  // carry
+            e.AluRegImm(4, kEax, 0xFF);
+            e.MovRegReg(vx, kEax);
+            e.MovRegReg(vf, kScratch);
+            break;
+          }
+          case 0x5: case 0x7: {  // 8xy5: SUB Vx, Vy; 8xy7: SUBN Vx, Vy
+            const bool subn = (opcode & 0x000F) == 0x7;
+            e.MovRegReg(kEax, subn ? vy : vx);
+            e.AluRegReg(0x29, kEax, subn ? vx : vy);
+            e.MovRegReg(kScratch, kEax);
+            e.Shift(5, kScratch, 31);  // borrow
+            e.AluRegImm(6, kScratch, 1);  // no borrow
+            e.AluRegImm(4, kEax, 0xFF);
+            e.MovRegReg(vx, kEax);
+            e.MovRegReg(vf, kScratch);
+            break;
+          }
+          case 0x6: {  // 8xy6: SHR Vx {, Vy}
+            e.MovRegReg(kScratch, vx);
+            e.AluRegImm(4, kScratch, 0x01);
+            e.Shift(5, vx, 1);
+            e.MovRegReg(vf, kScratch);
+            break;
+          }
+          case 0xE: {  // 8xyE: SHL Vx {, Vy}
+            e.MovRegReg(kScratch, vx);
+            e.Shift(5, kScratch, 7);
+            e.Shift(4, vx, 1);
+            e.AluRegImm(4, vx, 0xFF);
+            e.MovRegReg(vf, kScratch);
+            break;
+          }
+        }
+        written |= 1 << x;
+        if ((opcode & 0x000F) >= 0x4) written |= 1 << 0xF;
+        break;
+      }
+      case 0xA000: e.MovRegImm(kIndex, nnn); index_written = true; break;
+      case 0xF000: {
+        switch (kk) {
+          case 0x07: {  // Fx07: LD Vx, DT
+            e.LoadByte(vx, kEdx, 0);
+            written |= 1 << x;
+            break;
+          }
+          case 0x15: e.StoreByte(kEdx, 0, vx); break;  // Fx15: LD DT, Vx
+          case 0x18: e.StoreByte(kEcx, 0, vx); break;  // Fx18: LD ST, Vx
+          case 0x1E: {  // Fx1E: ADD I, Vx
+            e.AluRegReg(0x01, kIndex, vx);
+            e.AluRegImm(4, kIndex, 0xFFFF);
+            index_written = true;
+            break;
+          }
+          case 0x29: {  // Fx29: LD F, Vx
+            e.ImulImm(kIndex, vx, 5);
+            index_written = true;
+            break;
+          }
+        }
+        break;
+      }
+    }
+  }
+  e.MovRegImm(kEax, length << 16 | address);
+
+  // Write back and return; on a side exit, registers written later in the
+  // block still hold the values loaded on entry
+  for (int i = 0; i < num_side_exits; ++i) e.PatchToHere(side_exits[i]);
+  for (int r = 0; r < 16; ++r) {
+    if (written & (1 << r)) e.StoreByte(kEdi, r, pinned[r]);
+  }
+  if (index_written) e.StoreIndex();
+  for (int i = num_pinned - 1; i >= 0; --i) {
+    if (IsCalleeSaved(kPinnable[i])) e.Pop(kPinnable[i]);
+  }
+  e.Ret();
+
+  block.length = length;
+  block.code = reinterpret_cast<BlockFunction>(code_ + code_used_);
+  code_used_ += e.size();
+  for (int i = 0; i < length; ++i) {
+    translated_[addresses[i]] = translated_[addresses[i] + 1] = true;
+  }
+
+  if (mprotect(pages, pages_size, PROT_READ | PROT_EXEC) != 0) {
+    std::fprintf(stderr, "In Jit::Compile: failed to protect code buffer.\n");
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+#else
+
+void Jit::Compile(const uint16_t pc, const uint8_t* memory) {
+  static_cast<void>(memory);
+  blocks_[pc].length = 0;
+  blocks_[pc].code = NULL;
+}
+
+#endif  // CHIP8_JIT
@@ -0,0 +1,77 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_JIT_H_
+#define SRC_JIT_H_
+
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#  define CHIP8_JIT 1
+#else
+#  define CHIP8_JIT 0
+#endif
+
+
+// Translates CHIP-8 basic blocks into x86-64 code. A block is a trace of
+// register and timer instructions (6xkk, 7xkk, 8xyn, Annn, Fx07, Fx15,
+// Fx18, Fx1E, Fx29) that follows jumps (1nnn) and leaves through a side exit
+// when a skip (3xkk, 4xkk, 5xy0, 9xy0) is taken; it ends just before any
+// other instruction, which the caller interprets. It also leaves through a
+// side exit once it has run the budget it's called with, so blocks run even
+// in the last few instructions of a frame. Within a block the guest
+// registers it uses and index_ are pinned in host registers, and pc_ is a
+// compile-time constant.
+//
+// Where CHIP8_JIT is 0 every block is empty, so callers always interpret.
+class Jit {
+ public:
+  Jit(const int memory_size);
+  ~Jit();
+
+  // Returns the new pc in the low 16 bits and the number of instructions
+  // executed (at most budget, which is at least 1) in the high 16 bits;
+  // arguments are Chip8::v_, &Chip8::index_, &Chip8::delay_timer_ and
+  // &Chip8::sound_timer_
+  typedef uint32_t (*BlockFunction)(uint8_t* v, uint16_t* index,
+                                    uint8_t* delay_timer,
+                                    uint8_t* sound_timer, int budget);
+
+  struct Block {
+    int length;  // Most guest instructions executed; 0 if none could compile
+    BlockFunction code;
+  };
+
+  static const int kMaxBlockLength_;
+  static const Block kEmptyBlock_;
+
+  // Block starting at pc, compiled from memory on first use
+  inline const Block& Lookup(const uint16_t pc, const uint8_t* memory) {
+    if (pc >= memory_size_ - 1) return kEmptyBlock_;  // e.g. after Bnnn
+    if (blocks_[pc].length < 0) Compile(pc, memory);
+    return blocks_[pc];
+  }
+
+  // Memory at [address, address + count) is about to change; drop all
+  // compiled code if any block was translated from it
+  void Invalidate(const int address, const int count);
+  void Flush();
+
+ private:
+  const int memory_size_;
+  Block* blocks_;  // Indexed by pc; length < 0 until compiled
+  bool* translated_;  // Whether each byte of memory is in some block
+
+  // Executable except for the pages a block is being written to
+  static const int kCodeSize_;
+  uint8_t* code_;
+  int code_used_;
+  int page_size_;
+
+  void Compile(const uint16_t pc, const uint8_t* memory);
+};
+
+#endif  // SRC_JIT_H_
@@ -11,40 +11,46 @@
 
 
 const int Keyboard::kNumKeys_ = 16;
+const int Keyboard::kNumHostKeys_ = GLFW_KEY_LAST + 1;
+const unsigned Keyboard::kEventRingSize_ = 256;
+const uint32_t Keyboard::kPending_ = 1 << 16;
 
-// Map from Chip8 key to whether it is pressed;
-// static var to be used in glfwSetKeyCallback
-std::map<const uint8_t, bool>
-Keyboard::key_pressed_flag_ = std::map<const uint8_t, bool>({
-  {0x1, false}, {0x2, false}, {0x3, false}, {0xC, false},
-  {0x4, false}, {0x5, false}, {0x6, false}, {0xD, false},
-  {0x7, false}, {0x8, false}, {0x9, false}, {0xE, false},
-  {0xA, false}, {0x0, false}, {0xB, false}, {0xF, false},
-});
-
-// Map from key: Chip8 keyboard -- same as above,
-// make it static var to be used in glfwSetKeyCallback
-std::map<const uint8_t, const uint8_t>
-Keyboard::keymap_ = std::map<const uint8_t, const uint8_t>({
-  {GLFW_KEY_1, 0x1},  // 1: 1
-  {GLFW_KEY_2, 0x2},  // 2: 2
-  {GLFW_KEY_3, 0x3},  // 3: 3
-  {GLFW_KEY_4, 0xC},  // 4: C
-  {GLFW_KEY_Q, 0x4},  // Q: 4
-  {GLFW_KEY_W, 0x5},  // W: 5
-  {GLFW_KEY_E, 0x6},  // E: 6
-  {GLFW_KEY_R, 0xD},  // R: D
-  {GLFW_KEY_A, 0x7},  // A: 7
-  {GLFW_KEY_S, 0x8},  // S: 8
-  {GLFW_KEY_D, 0x9},  // D: 9
-  {GLFW_KEY_F, 0xE},  // F: E
-  {GLFW_KEY_Z, 0xA},  // Z: A
-  {GLFW_KEY_X, 0x0},  // X: 0
-  {GLFW_KEY_C, 0xB},  // C: B
-  {GLFW_KEY_V, 0xF},  // V: F
-});
-
-Keyboard::Keyboard() {}
+Keyboard::Keyboard()
+  : keys_pressed_(0),
+    events_(new KeyEvent[kEventRingSize_]),
+    events_written_(0),
+    events_read_(0),
+    applied_keys_(0),
+    pending_keys_(0),
+    pending_time_(0),
+    applying_pending_(false),
+    commands_(0),
+    rewinding_(false) {
+  // Map from key: Chip8 keyboard
+  keymap_ = new int8_t[kNumHostKeys_];
+  for (int key = 0; key < kNumHostKeys_; ++key) keymap_[key] = -1;
+  keymap_[GLFW_KEY_1] = 0x1;  // 1: 1
+  keymap_[GLFW_KEY_2] = 0x2;  // 2: 2
+  keymap_[GLFW_KEY_3] = 0x3;  // 3: 3
+  keymap_[GLFW_KEY_4] = 0xC;  // 4: C
+  keymap_[GLFW_KEY_Q] = 0x4;  // Q: 4
+  keymap_[GLFW_KEY_W] = 0x5;  // W: 5
+  keymap_[GLFW_KEY_E] = 0x6;  // E: 6
+  keymap_[GLFW_KEY_R] = 0xD;  // R: D
+  keymap_[GLFW_KEY_A] = 0x7;  // A: 7
+  keymap_[GLFW_KEY_S] = 0x8;  // S: 8
+  keymap_[GLFW_KEY_D] = 0x9;  // D: 9
+  keymap_[GLFW_KEY_F] = 0xE;  // F: E
+  keymap_[GLFW_KEY_Z] = 0xA;  // Z: A
+  keymap_[GLFW_KEY_X] = 0x0;  // X: 0
+  keymap_[GLFW_KEY_C] = 0xB;  // C: B
+  keymap_[GLFW_KEY_V] = 0xF;  // V: F
+}
+
+Keyboard::~Keyboard() {
+  delete[] keymap_;
+  delete[] events_;
+}
 
 void Keyboard::QueryInput(
   GLFWwindow* window,
@@ -61,17 +67,90 @@ void Keyboard::QueryInput(
     glfwSetWindowShouldClose(window, true);
   }
 
-  // Accept only a valid key input (catches the ESC case)
-  if (keymap_.find(key) == keymap_.end()) return;
+  // Hotkeys
+  if (key == GLFW_KEY_F5 && action == GLFW_PRESS) {
+    commands_.fetch_or(1 << kSaveState, std::memory_order_relaxed);
+  } else if (key == GLFW_KEY_F7 && action == GLFW_PRESS) {
+    commands_.fetch_or(1 << kLoadState, std::memory_order_relaxed);
+  } else if (key == GLFW_KEY_BACKSPACE && action != GLFW_REPEAT) {
+    rewinding_.store(action == GLFW_PRESS, std::memory_order_relaxed);
+  }
+
+  // Accept only a valid key input (catches the ESC case, and
+  // GLFW_KEY_UNKNOWN)
+  if (key < 0 || key >= kNumHostKeys_ || keymap_[key] < 0) return;
 
+  const std::chrono::steady_clock::time_point now
+    = std::chrono::steady_clock::now();
+  const uint16_t bit = static_cast<uint16_t>(1 << keymap_[key]);
+  uint16_t keys;
   if (action == GLFW_PRESS) {
-    key_pressed_flag_[keymap_[key]] = true;
+    keys = keys_pressed_.fetch_or(bit, std::memory_order_relaxed) | bit;
   } else if (action == GLFW_RELEASE) {
-    key_pressed_flag_[keymap_[key]] = false;
+    keys = keys_pressed_.fetch_and(static_cast<uint16_t>(~bit),
+                                   std::memory_order_relaxed) & ~bit;
+  } else {
+    return;  // Repeat
+  }
+
+  // Queue the change, or fold it into the pending one if the emulator has
+  // fallen a whole ring behind
+  const unsigned written = events_written_.load(std::memory_order_relaxed);
+  if ((pending_keys_.load(std::memory_order_acquire) & kPending_)
+   || written - events_read_.load(std::memory_order_acquire)
+      == kEventRingSize_) {
+    pending_time_.store(now.time_since_epoch().count(),
+                        std::memory_order_relaxed);
+    pending_keys_.store(kPending_ | keys, std::memory_order_release);
+    return;
+  }
+  events_[written & (kEventRingSize_ - 1)].time = now;
+  events_[written & (kEventRingSize_ - 1)].keys = keys;
+  events_written_.store(written + 1, std::memory_order_release);
+}
+
+uint16_t Keyboard::PressedKeys() {
+  return applied_keys_;
+}
+
+bool Keyboard::NextKeyEvent(std::chrono::steady_clock::time_point* time) {
+  const unsigned read = events_read_.load(std::memory_order_relaxed);
+  if (read != events_written_.load(std::memory_order_acquire)) {
+    *time = events_[read & (kEventRingSize_ - 1)].time;
+    applying_pending_ = false;
+    return true;
   }
+  if (pending_keys_.load(std::memory_order_acquire) & kPending_) {
+    *time = std::chrono::steady_clock::time_point(
+      std::chrono::steady_clock::duration(
+        pending_time_.load(std::memory_order_relaxed)));
+    applying_pending_ = true;
+    return true;
+  }
+  return false;
+}
+
+void Keyboard::ApplyKeyEvent() {
+  if (applying_pending_) {
+    applied_keys_ = static_cast<uint16_t>(
+      pending_keys_.exchange(0, std::memory_order_acq_rel));
+    applying_pending_ = false;
+    return;
+  }
+  const unsigned read = events_read_.load(std::memory_order_relaxed);
+  applied_keys_ = events_[read & (kEventRingSize_ - 1)].keys;
+  events_read_.store(read + 1, std::memory_order_release);
+}
+
+KeyboardInterface::Command Keyboard::TakeCommand() {
+  const unsigned commands = commands_.load(std::memory_order_relaxed);
+  if (!commands) return kNoCommand;
+  int command = 0;
+  while (!((commands >> command) & 1)) ++command;  // Lowest pending
+  commands_.fetch_and(~(1u << command), std::memory_order_relaxed);
+  return static_cast<Command>(command);
 }
 
-bool Keyboard::KeyIsPressed(uint8_t key) {
-  if (key_pressed_flag_.find(key) == key_pressed_flag_.end()) return false;
-  return key_pressed_flag_[key];
+bool Keyboard::CommandHeld(const Command command) {
+  return command == kRewind && rewinding_.load(std::memory_order_relaxed);
 }
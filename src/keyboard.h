@@ -10,24 +10,71 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#include <map>
+#include <atomic>
+#include <chrono>
 
+#include "src/frontend.h"
 
-class Keyboard {
+
+class Keyboard : public KeyboardInterface {
  public:
   Keyboard();
 
   static const int kNumKeys_;
-  static std::map<const uint8_t, const uint8_t> keymap_;
-  static std::map<const uint8_t, bool> key_pressed_flag_;
 
-  static void QueryInput(
+  // Chip8 key of each GLFW key code, or -1; a flat table, so mapping a host
+  // key is one load
+  static const int kNumHostKeys_;
+  int8_t* keymap_;
+
+  // Bit k set while Chip8 key k is held, as the event thread last saw
+  std::atomic<uint16_t> keys_pressed_;
+
+  // Key changes go from QueryInput on the event thread to the emulation
+  // thread through a lock-free single-producer single-consumer ring, each
+  // stamped with when QueryInput saw it and carrying every key held after
+  // it. GLFW delivers key events only when the event thread polls, which
+  // Display::Refresh does after each swap (or at once while it's idle), so
+  // a stamp may be up to one display refresh later than the key itself.
+  // PressedKeys returns applied_keys_, the keys held as of the last change
+  // the emulator applied
+  struct KeyEvent {
+    std::chrono::steady_clock::time_point time;
+    uint16_t keys;
+  };
+  static const unsigned kEventRingSize_;  // Power of two
+  KeyEvent* events_;
+  std::atomic<unsigned> events_written_, events_read_;
+  uint16_t applied_keys_;
+
+  // Changes made while the ring is full fold into one pending change, the
+  // keys held after the latest (with kPending_ set) and its time, applied
+  // once the ring has drained; until then later changes fold into it too,
+  // so changes stay in order and a release is never lost
+  static const uint32_t kPending_;
+  std::atomic<uint32_t> pending_keys_;
+  std::atomic<std::chrono::steady_clock::rep> pending_time_;
+  bool applying_pending_;  // NextKeyEvent's event is the pending one
+
+  // Hotkeys F5 (save state) and F7 (load state): bit c set while command c
+  // waits to be taken; and Backspace, held to rewind
+  std::atomic<unsigned> commands_;
+  std::atomic<bool> rewinding_;
+
+  // Key event from the window (Display forwards its GLFW key callback)
+  void QueryInput(
     GLFWwindow* window,
     int key,
     int scancode,
     int action,
     int mods);
 
-  bool KeyIsPressed(uint8_t keycode);
+  uint16_t PressedKeys();
+  bool NextKeyEvent(std::chrono::steady_clock::time_point* time);
+  void ApplyKeyEvent();
+  Command TakeCommand();
+  bool CommandHeld(const Command command);
+
+  ~Keyboard();
 };
 #endif  // SRC_KEYBOARD_H_
@@ -0,0 +1,431 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include "src/lockstep.h"
+
+#include <cstring>
+
+#include "src/chip8.h"
+
+// One SSE2 or AVX2 register of 16-bit lanes
+#if defined(__AVX2__)
+#  define CHIP8_LANES 16
+#else
+#  define CHIP8_LANES 8
+#endif
+
+
+// Registers, timers and the stack pointer are kept in 16-bit lanes too, and
+// masked to 8 bits, so that every vector is one register wide. Comparisons
+// give all-ones lanes where true. Aligned to 16 so that groups can come from
+// plain new
+typedef uint16_t Lanes
+  __attribute__((vector_size(2*CHIP8_LANES), aligned(16)));
+typedef int16_t LaneMask
+  __attribute__((vector_size(2*CHIP8_LANES), aligned(16)));
+typedef uint8_t LaneBytes
+  __attribute__((vector_size(CHIP8_LANES), aligned(1)));
+
+const int Chip8Lockstep::kLanes_ = CHIP8_LANES;
+
+// Addresses are 12 bits, as nnn covers the whole of memory
+static const uint16_t kAddressMask = Chip8::kMemorySize_ - 1;
+
+// Sizes are Chip8's. Memory is interleaved by lane, so that lanes at the same
+// address fetch their opcodes with two vector loads. Halted lanes are all
+// ones in `halted`, and keep their state as it was at the unknown opcode
+struct Chip8Lockstep::Group {
+  Lanes v[16];
+  Lanes index, pc, sp;
+  Lanes stack[16];
+  Lanes delay_timer, sound_timer;
+  Lanes halted;
+  int num_halted;
+  int unknown_opcode[CHIP8_LANES];
+
+  uint8_t memory[Chip8::kMemorySize_][CHIP8_LANES];
+  uint64_t pixels[CHIP8_LANES][32];  // Rows as in Chip8
+  Xoshiro128 random[CHIP8_LANES];
+};
+
+// These helpers pass vectors by value, for which GCC notes that the ABI
+// differs with and without AVX; they're only called within this file
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+static inline Lanes Mask(const LaneMask mask) {
+  return reinterpret_cast<Lanes>(mask);
+}
+
+static inline Lanes Select(const Lanes mask, const Lanes a, const Lanes b) {
+  return (a & mask) | (b & ~mask);
+}
+
+static inline bool All(const LaneMask mask) {
+  uint64_t words[sizeof(Lanes)/sizeof(uint64_t)];
+  std::memcpy(words, &mask, sizeof(Lanes));
+  uint64_t all = ~0ULL;
+  for (uint64_t word : words) all &= word;
+  return all == ~0ULL;
+}
+
+static inline Lanes Load(const uint8_t* address) {
+  return __builtin_convertvector(
+    *reinterpret_cast<const LaneBytes*>(address), Lanes);
+}
+
+#pragma GCC diagnostic pop
+
+Chip8Lockstep::Chip8Lockstep(const int num_instances)
+  : num_instances_((num_instances + kLanes_ - 1)/kLanes_*kLanes_),
+    num_groups_(num_instances_/kLanes_) {
+  keys_ = new uint16_t[num_instances_]();
+  instructions_per_second_ = Chip8::kDefaultInstructionsPerSecond_;
+  budget_carry_ = 0.;
+  wrap_around_y_ = false;
+  seed_ = Chip8::kDefaultSeed_;
+  instructions_ = 0;
+
+  groups_ = new Group[num_groups_];
+  for (int g = 0; g < num_groups_; ++g) {
+    std::memset(&groups_[g], 0, sizeof(Group));
+    groups_[g].pc += static_cast<uint16_t>(Chip8::kProgramAddress_);
+    for (int lane = 0; lane < kLanes_; ++lane) {
+      groups_[g].unknown_opcode[lane] = -1;
+    }
+    for (int i = 0; i < Chip8::kBytesPerFontSprite_*Chip8::kNumFontSprites_;
+         ++i) {
+      std::memset(groups_[g].memory[Chip8::kFontSpritesAddress_ + i],
+                  Chip8::kFontSprites_[i], kLanes_);
+    }
+  }
+}
+
+Chip8Lockstep::~Chip8Lockstep() {
+  delete[] keys_;
+  delete[] groups_;
+}
+
+void Chip8Lockstep::LoadProgram(const std::string& path_to_rom) {
+  uint8_t* program = new uint8_t[Chip8::kMaxProgramSize_]();
+  Chip8::LoadProgram(path_to_rom, program);
+  for (int g = 0; g < num_groups_; ++g) {
+    for (int i = 0; i < Chip8::kMaxProgramSize_; ++i) {
+      std::memset(groups_[g].memory[Chip8::kProgramAddress_ + i], program[i],
+                  kLanes_);
+    }
+    for (int lane = 0; lane < kLanes_; ++lane) {
+      groups_[g].random[lane].Seed(seed_);
+    }
+  }
+  delete[] program;
+}
+
+int Chip8Lockstep::FrameBudget() {
+  budget_carry_ += instructions_per_second_/Chip8::kFramesPerSecond_;
+  const int budget = static_cast<int>(budget_carry_);
+  budget_carry_ -= budget;
+  return budget;
+}
+
+void Chip8Lockstep::EmulateCycle() {
+  const int budget = FrameBudget();
+  for (int g = 0; g < num_groups_; ++g) {
+    Group* group = &groups_[g];
+    const uint16_t* keys = &keys_[g*kLanes_];
+    for (int i = 0; i < budget && group->num_halted < kLanes_; ++i) {
+      instructions_ += kLanes_ - group->num_halted;
+      Step(group, keys);
+    }
+
+    // Timers
+    const Lanes running = ~group->halted;
+    group->delay_timer -= running & Mask(group->delay_timer > 0) & 1;
+    group->sound_timer -= running & Mask(group->sound_timer > 0) & 1;
+  }
+}
+
+void Chip8Lockstep::Step(Group* group, const uint16_t* keys) {
+  const Lanes none = {};
+  const Lanes all = ~none;
+
+  // Fetch each lane's opcode, with vector loads if every lane is at the same
+  // address (the usual case)
+  Lanes opcode;
+  const uint16_t pc = group->pc[0];
+  if (All(group->pc == pc) && pc + 1 < Chip8::kMemorySize_) {
+    opcode = Load(group->memory[pc]) << 8 | Load(group->memory[pc + 1]);
+  } else {
+    for (int lane = 0; lane < kLanes_; ++lane) {
+      const int address = group->pc[lane];
+      opcode[lane] = (address + 1 < Chip8::kMemorySize_)
+        ? group->memory[address][lane] << 8 | group->memory[address + 1][lane]
+        : 0;
+    }
+  }
+
+  if (!group->num_halted && All(opcode == opcode[0])) {
+    Execute(group, opcode[0], reinterpret_cast<const uint16_t*>(&all), keys);
+    return;
+  }
+
+  // Run the first pending lane's opcode on every lane that has it, until
+  // every running lane has run one instruction
+  Lanes pending = ~group->halted;
+  for (int lane = 0; lane < kLanes_; ++lane) {
+    if (!pending[lane]) continue;
+    const Lanes mask = Mask(opcode == opcode[lane]) & pending;
+    Execute(group, opcode[lane], reinterpret_cast<const uint16_t*>(&mask),
+            keys);
+    pending &= ~mask;
+  }
+}
+
+void Chip8Lockstep::Execute(Group* group, const uint16_t opcode,
+                            const uint16_t* lane_mask, const uint16_t* keys) {
+  Lanes mask;
+  std::memcpy(&mask, lane_mask, sizeof(Lanes));
+  const uint8_t x = (opcode >> 8) & 0x000F;
+  const uint8_t y = (opcode >> 4) & 0x000F;
+  const uint8_t n = opcode & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  const uint16_t nnn = opcode & kAddressMask;
+  const Lanes zero = {};
+  Lanes& vx = group->v[x];
+  Lanes& vf = group->v[0xF];
+  const Lanes vy = group->v[y];
+
+  group->pc += mask & 2;
+
+  switch (Chip8::instruction_table_[opcode]) {
+    case Chip8::kOp00E0: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (mask[lane]) std::memset(group->pixels[lane], 0, 32*8);
+      }
+      break;
+    }
+    case Chip8::kOp00EE: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        group->sp[lane] = (group->sp[lane] - 1) & 0xFF;
+        group->pc[lane] = group->stack[group->sp[lane] & 0xF][lane];
+      }
+      break;
+    }
+    case Chip8::kOp1nnn: group->pc = Select(mask, zero + nnn, group->pc); break;
+    case Chip8::kOp2nnn: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        group->stack[group->sp[lane] & 0xF][lane] = group->pc[lane];
+        group->sp[lane] = (group->sp[lane] + 1) & 0xFF;
+      }
+      group->pc = Select(mask, zero + nnn, group->pc);
+      break;
+    }
+    case Chip8::kOp3xkk: group->pc += mask & Mask(vx == kk) & 2; break;
+    case Chip8::kOp4xkk: group->pc += mask & Mask(vx != kk) & 2; break;
+    case Chip8::kOp5xy0: group->pc += mask & Mask(vx == vy) & 2; break;
+    case Chip8::kOp6xkk: vx = Select(mask, zero + kk, vx); break;
+    case Chip8::kOp7xkk: vx = Select(mask, (vx + kk) & 0xFF, vx); break;
+    case Chip8::kOp8xy0: vx = Select(mask, vy, vx); break;
+    case Chip8::kOp8xy1: vx = Select(mask, vx | vy, vx); break;
+    case Chip8::kOp8xy2: vx = Select(mask, vx & vy, vx); break;
+    case Chip8::kOp8xy3: vx = Select(mask, vx ^ vy, vx); break;
+    case Chip8::kOp8xy4: {
+      const Lanes sum = vx + vy;
+      vx = Select(mask, sum & 0xFF, vx);
+      vf = Select(mask, sum >> 8, vf);
+      break;
+    }
+    case Chip8::kOp8xy5: {
+      const Lanes no_borrow = Mask(vx >= vy) & 1;
+      vx = Select(mask, (vx - vy) & 0xFF, vx);
+      vf = Select(mask, no_borrow, vf);
+      break;
+    }
+    case Chip8::kOp8xy6: {
+      const Lanes lsb = vx & 1;
+      vx = Select(mask, vx >> 1, vx);
+      vf = Select(mask, lsb, vf);
+      break;
+    }
+    case Chip8::kOp8xy7: {
+      const Lanes no_borrow = Mask(vy >= vx) & 1;
+      vx = Select(mask, (vy - vx) & 0xFF, vx);
+      vf = Select(mask, no_borrow, vf);
+      break;
+    }
+    case Chip8::kOp8xyE: {
+      const Lanes msb = vx >> 7;
+      vx = Select(mask, (vx << 1) & 0xFF, vx);
+      vf = Select(mask, msb, vf);
+      break;
+    }
+    case Chip8::kOp9xy0: group->pc += mask & Mask(vx != vy) & 2; break;
+    case Chip8::kOpAnnn: {
+      group->index = Select(mask, zero + nnn, group->index);
+      break;
+    }
+    case Chip8::kOpBnnn: {
+      group->pc = Select(mask, group->v[0] + nnn, group->pc);
+      break;
+    }
+    case Chip8::kOpCxkk: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        vx[lane] = (group->random[lane].Next() >> 24) & kk;
+      }
+      break;
+    }
+    case Chip8::kOpDxyn: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        vf[lane] = DrawSprite(group, lane, vy[lane], vx[lane], n) ? 1 : 0;
+      }
+      break;
+    }
+    case Chip8::kOpEx9E: case Chip8::kOpExA1: {
+      Lanes skip;
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        const bool pressed = vx[lane] < 16 && ((keys[lane] >> vx[lane]) & 1);
+        skip[lane] = (pressed == (kk == 0x9E)) ? 2 : 0;
+      }
+      group->pc += mask & skip;
+      break;
+    }
+    case Chip8::kOpFx07: vx = Select(mask, group->delay_timer, vx); break;
+    case Chip8::kOpFx0A: {
+      // As in Chip8, re-execute until a key is pressed
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        if (keys[lane]) {
+          vx[lane] = __builtin_ctz(keys[lane]);
+        } else {
+          group->pc[lane] -= 2;
+        }
+      }
+      break;
+    }
+    case Chip8::kOpFx15: {
+      group->delay_timer = Select(mask, vx, group->delay_timer);
+      break;
+    }
+    case Chip8::kOpFx18: {
+      group->sound_timer = Select(mask, vx, group->sound_timer);
+      break;
+    }
+    case Chip8::kOpFx1E: {
+      group->index = Select(mask, group->index + vx, group->index);
+      break;
+    }
+    case Chip8::kOpFx29: {
+      group->index = Select(
+        mask, vx*static_cast<uint16_t>(Chip8::kBytesPerFontSprite_),
+        group->index);
+      break;
+    }
+    case Chip8::kOpFx33: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        const uint8_t digits[3] = {
+          static_cast<uint8_t>((vx[lane]/100)%10),
+          static_cast<uint8_t>((vx[lane]/ 10)%10),
+          static_cast<uint8_t>((vx[lane]/  1)%10)
+        };
+        for (int i = 0; i < 3; ++i) {
+          const int address = group->index[lane] + i;
+          if (address < Chip8::kMemorySize_) {
+            group->memory[address][lane] = digits[i];
+          }
+        }
+      }
+      break;
+    }
+    case Chip8::kOpFx55: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        for (int i = 0; i <= x; ++i) {
+          const int address = group->index[lane] + i;
+          if (address >= Chip8::kMemorySize_) break;
+          group->memory[address][lane] = group->v[i][lane];
+        }
+      }
+      break;
+    }
+    case Chip8::kOpFx65: {
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        for (int i = 0; i <= x; ++i) {
+          const int address = group->index[lane] + i;
+          group->v[i][lane]
+            = address < Chip8::kMemorySize_ ? group->memory[address][lane] : 0;
+        }
+      }
+      break;
+    }
+    default: {
+      // Halt these lanes at the opcode, leaving the others running
+      for (int lane = 0; lane < kLanes_; ++lane) {
+        if (!mask[lane]) continue;
+        group->pc[lane] -= 2;
+        group->halted[lane] = ~0;
+        group->unknown_opcode[lane] = opcode;
+        ++group->num_halted;
+      }
+      break;
+    }
+  }
+}
+
+bool Chip8Lockstep::DrawSprite(Group* group, const int lane,
+                               const int i0, const int j0, const int n) {
+  // As Chip8::DrawSpriteToPixelBuffer
+  const int shift = j0%64;
+  uint64_t collision = 0;
+  for (int di = 0; di < n; ++di) {
+    int i = i0 + di;
+    if (!wrap_around_y_ && i >= 32) break;
+    i %= 32;
+
+    const int address = group->index[lane] + di;
+    const uint64_t row = static_cast<uint64_t>(
+      address < Chip8::kMemorySize_ ? group->memory[address][lane] : 0) << 56;
+    const uint64_t sprite = shift ? (row >> shift | row << (64 - shift)) : row;
+    collision |= group->pixels[lane][i] & sprite;
+    group->pixels[lane][i] ^= sprite;
+  }
+  return collision != 0;
+}
+
+void Chip8Lockstep::CopyTo(const int instance, Chip8* chip8) const {
+  const Group& group = groups_[instance/kLanes_];
+  const int lane = instance%kLanes_;
+
+  for (int i = 0; i < Chip8::kMemorySize_; ++i) {
+    chip8->memory_[i] = group.memory[i][lane];
+  }
+  chip8->InvalidateDecodeCache();
+  for (int i = 0; i < Chip8::kRegistersSize_; ++i) {
+    chip8->v_[i] = group.v[i][lane];
+  }
+  for (int i = 0; i < Chip8::kStackSize_; ++i) {
+    chip8->stack_[i] = group.stack[i][lane];
+  }
+  chip8->index_ = group.index[lane];
+  chip8->pc_ = group.pc[lane];
+  chip8->sp_ = group.sp[lane];
+  chip8->delay_timer_ = group.delay_timer[lane];
+  chip8->sound_timer_ = group.sound_timer[lane];
+  chip8->random_ = group.random[lane];
+  chip8->budget_carry_ = budget_carry_;
+  std::memcpy(chip8->pixel_buffer_, group.pixels[lane],
+              Chip8::kRows_*sizeof(chip8->pixel_buffer_[0]));
+  chip8->MarkDirty(0, Chip8::kRows_);
+}
+
+int Chip8Lockstep::UnknownOpcode(const int instance) const {
+  return groups_[instance/kLanes_].unknown_opcode[instance%kLanes_];
+}
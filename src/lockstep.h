@@ -0,0 +1,76 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_LOCKSTEP_H_
+#define SRC_LOCKSTEP_H_
+
+#include <cstdint>
+#include <string>
+
+class Chip8;
+
+
+// Many instances of one ROM, e.g. for fuzzing with different inputs, stepped
+// in lockstep with SIMD. Instances are grouped kLanes_ at a time, and each
+// group keeps its registers, index, pc, stack pointer, stack and timers as
+// lane-wide vectors (structure of arrays); memory and pixel buffers are per
+// instance. Every step each lane runs exactly one instruction: lanes whose
+// opcode matches run it together under a lane mask, then the rest the same
+// way, so each instance ends every frame in the same state as Chip8 running
+// the same ROM with the same keys held. An instance that reaches an unknown
+// instruction halts there, and the rest carry on.
+//
+// kLanes_ is 16 when built with AVX2 (e.g. -mavx2) and 8 otherwise (SSE2 on
+// x86-64); the vectors use GCC/Clang vector extensions.
+class Chip8Lockstep {
+ public:
+  explicit Chip8Lockstep(const int num_instances);
+  ~Chip8Lockstep();
+
+  static const int kLanes_;
+
+  // Rounded up to a whole number of groups
+  const int num_instances_;
+
+  // Bitmask of the keys each instance holds down; set between frames
+  uint16_t* keys_;
+
+  // Configuration, as for Chip8; every instance's random_ starts from seed_
+  // (Chip8::kDefaultSeed_ by default) at LoadProgram, and frames get their
+  // instructions from instructions_per_second_ as Chip8::FrameBudget gives
+  // them
+  double instructions_per_second_;
+  double budget_carry_;
+  bool wrap_around_y_;
+  uint64_t seed_;
+
+  int64_t instructions_;  // Run over all frames and instances
+
+  void LoadProgram(const std::string& path_to_rom);
+  void EmulateCycle();  // One frame of every instance
+
+  // Copy an instance's machine state into chip8, e.g. to compare or hash it
+  void CopyTo(const int instance, Chip8* chip8) const;
+
+  // The unknown instruction an instance halted at, or -1 if it's running
+  int UnknownOpcode(const int instance) const;
+
+ private:
+  struct Group;
+  const int num_groups_;
+  Group* groups_;
+
+  int FrameBudget();
+  void Step(Group* group, const uint16_t* keys);
+
+  // Run opcode on the lanes whose lane_mask is all ones
+  void Execute(Group* group, const uint16_t opcode, const uint16_t* lane_mask,
+               const uint16_t* keys);
+  bool DrawSprite(Group* group, const int lane, const int i0, const int j0,
+                  const int n);
+};
+
+#endif  // SRC_LOCKSTEP_H_
@@ -6,11 +6,17 @@
  */
 #include <assert.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <random>
 #include <vector>
 #include <functional>
 
 #include "src/chip8.h"
+#include "src/display.h"
+#include "src/keyboard.h"
+#include "src/sound.h"
 #include "src/parser.h"
 #include "src/chip8_option.h"
 
@@ -174,6 +180,128 @@ int main(int argc, char* argv[]) {
   parser.chip8_options_.push_back(
     std::unique_ptr<Chip8OptionInterface>(color_scheme_option));
 
+  // `s`: instructions per second?
+  auto ips_option_valid_argument_test
+  = [=](const std::string& selection) {
+    if (selection == "max") return true;
+    if (selection.empty() || selection.size() > 9) return false;
+    for (auto c : selection) { if (!std::isdigit(c)) return false; }
+    return std::stoi(selection) >= Chip8::kFramesPerSecond_;
+  };
+  auto ips_option = new Chip8Option<
+    decltype(ips_option_valid_argument_test)
+  >(
+    {"-s", "--ips"},
+    ips_option_valid_argument_test,
+    "  -s (--ips) [ integer >= 60; max; default=1080; ]: instructions per\n"
+    "    second, spread evenly over the 60 Hz frames; `max` runs frames of\n"
+    "    the default size back to back, as fast as possible.\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(ips_option));
+
+  // `sd`: random seed?
+  auto seed_option_valid_argument_test
+  = [=](const std::string& selection) {
+    if (selection.empty() || selection.size() > 19) return false;
+    for (auto c : selection) { if (!std::isdigit(c)) return false; }
+    return true;
+  };
+  auto seed_option = new Chip8Option<
+    decltype(seed_option_valid_argument_test)
+  >(
+    {"-sd", "--seed"},
+    seed_option_valid_argument_test,
+    "  -sd (--seed) [ integer in the range [0, 10^19); default=random; ]:\n"
+    "    seed for the random numbers of Cxkk; with the same seed, ROM and\n"
+    "    options, a ROM that isn't given input runs the same every time.\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(seed_option));
+
+  // `rw`: rewind history size?
+  auto rewind_option_valid_argument_test
+  = [=](const std::string& selection) {
+    if (selection.empty() || selection.size() > 4) return false;
+    for (auto c : selection) { if (!std::isdigit(c)) return false; }
+    return std::stoi(selection) <= 1024;
+  };
+  auto rewind_option = new Chip8Option<
+    decltype(rewind_option_valid_argument_test)
+  >(
+    {"-rw", "--rewind"},
+    rewind_option_valid_argument_test,
+    "  -rw (--rewind) [ integer in the range [0, 1024]; default=4; ]:\n"
+    "    megabytes of history to keep for rewinding (hold Backspace), a few\n"
+    "    minutes per megabyte for most ROMs; 0 turns rewinding off.\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(rewind_option));
+
+  // `ra`: run-ahead frames?
+  auto run_ahead_option_valid_argument_test
+  = [=](const std::string& selection) {
+    return selection.size() == 1 && std::isdigit(selection[0])
+      && selection[0] - '0' <= Chip8::kMaxRunAhead_;
+  };
+  auto run_ahead_option = new Chip8Option<
+    decltype(run_ahead_option_valid_argument_test)
+  >(
+    {"-ra", "--run-ahead"},
+    run_ahead_option_valid_argument_test,
+    "  -ra (--run-ahead) [ integer in the range [0, 8]; default=0; ]:\n"
+    "    frames to run ahead of the machine, showing a screen that answers\n"
+    "    input that many frames (1/60 s each) sooner; more than a frame or\n"
+    "    two can make motion jump when input changes.\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(run_ahead_option));
+
+  // `d`: instruction dispatch engine?
+  auto dispatch_option_valid_argument_test
+  = [=](const std::string& selection) {
+    const std::list<std::string> valid_selections = {
+      "switch", "table", "cached", "fused", "jit", "compiled"
+    };
+    return (
+      std::find(
+        valid_selections.begin(),
+        valid_selections.end(),
+        selection) != valid_selections.end() );
+  };
+  auto dispatch_option = new Chip8Option<
+    decltype(dispatch_option_valid_argument_test)
+  >(
+    {"-d", "--dispatch"},
+    dispatch_option_valid_argument_test,
+    "  -d (--dispatch) [ switch; table; cached; fused; jit; compiled;\n"
+    "    default=switch; ]: instruction dispatch engine; `table` looks up\n"
+    "    each opcode's handler in a table (threaded code where the compiler\n"
+    "    supports it); `cached` also keeps each decoded instruction per\n"
+    "    address; `fused` also runs common instruction sequences as one;\n"
+    "    `jit` compiles register-only basic blocks to x86-64 (else\n"
+    "    `cached`); `compiled` runs the ROM's code built in by chip8_aot,\n"
+    "    if any (else `cached`).\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(dispatch_option));
+
+  // `t`: trace instructions?
+  auto trace_option_valid_argument_test
+  = [=](const std::string& selection) {
+    const std::list<std::string> valid_selections = {"off", "print", "step"};
+    return (
+      std::find(
+        valid_selections.begin(),
+        valid_selections.end(),
+        selection) != valid_selections.end() );
+  };
+  auto trace_option = new Chip8Option<
+    decltype(trace_option_valid_argument_test)
+  >(
+    {"-t", "--trace"},
+    trace_option_valid_argument_test,
+    "  -t (--trace) [ off; print; step; default=off, step in DEBUG build; ]:\n"
+    "    print machine state, each instruction and the screen to stderr;\n"
+    "    `step` also waits for ENTER before each instruction.\n");
+  parser.chip8_options_.push_back(
+    std::unique_ptr<Chip8OptionInterface>(trace_option));
+
   // `help`: print all options
   auto help_option_valid_argument_test = [=](){ return true; };
   auto help_option = new Chip8Option<decltype(help_option_valid_argument_test)>(
@@ -214,7 +342,10 @@ int main(int argc, char* argv[]) {
 
     if ( parser.IsCommandLineOption(play_option->aliases_)
       && play_option->ArgumentIsValid(path_to_rom) ) {
-      Chip8 chip8;
+      // GLFW/OpenGL frontend; chip8 takes ownership
+      Keyboard* keyboard = new Keyboard();
+      Display* display = new Display(Chip8::kRows_, Chip8::kCols_, keyboard);
+      Chip8 chip8(display, new Sound(), keyboard);
 
       /*
         Configure chip8
@@ -250,7 +381,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.background_red_pixel_value_ = std::stoi(
+        display->background_red_pixel_value_ = std::stoi(
           background_red_pixel_value);
       }
 
@@ -270,7 +401,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.background_green_pixel_value_ = std::stoi(
+        display->background_green_pixel_value_ = std::stoi(
           background_green_pixel_value);
       }
 
@@ -290,7 +421,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.background_blue_pixel_value_ = std::stoi(
+        display->background_blue_pixel_value_ = std::stoi(
           background_blue_pixel_value);
       }
 
@@ -310,7 +441,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.foreground_red_pixel_value_ = std::stoi(
+        display->foreground_red_pixel_value_ = std::stoi(
           foreground_red_pixel_value);
       }
 
@@ -330,7 +461,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.foreground_green_pixel_value_ = std::stoi(
+        display->foreground_green_pixel_value_ = std::stoi(
           foreground_green_pixel_value);
       }
 
@@ -350,7 +481,7 @@ int main(int argc, char* argv[]) {
           return 0;
         }
 
-        chip8.foreground_blue_pixel_value_ = std::stoi(
+        display->foreground_blue_pixel_value_ = std::stoi(
           foreground_blue_pixel_value);
       }
 
@@ -367,40 +498,159 @@ int main(int argc, char* argv[]) {
         }
 
         if (color_scheme == "bw" || color_scheme == "black-white") {
-          chip8.foreground_red_pixel_value_ = 255;
-          chip8.foreground_green_pixel_value_ = 255;
-          chip8.foreground_blue_pixel_value_ = 255;
-          chip8.background_red_pixel_value_ = 0;
-          chip8.background_green_pixel_value_ = 0;
-          chip8.background_blue_pixel_value_ = 0;
+          display->foreground_red_pixel_value_ = 255;
+          display->foreground_green_pixel_value_ = 255;
+          display->foreground_blue_pixel_value_ = 255;
+          display->background_red_pixel_value_ = 0;
+          display->background_green_pixel_value_ = 0;
+          display->background_blue_pixel_value_ = 0;
         } else if (color_scheme == "wb" || color_scheme == "white-black") {
-          chip8.foreground_red_pixel_value_ = 0;
-          chip8.foreground_green_pixel_value_ = 0;
-          chip8.foreground_blue_pixel_value_ = 0;
-          chip8.background_red_pixel_value_ = 255;
-          chip8.background_green_pixel_value_ = 255;
-          chip8.background_blue_pixel_value_ = 255;
+          display->foreground_red_pixel_value_ = 0;
+          display->foreground_green_pixel_value_ = 0;
+          display->foreground_blue_pixel_value_ = 0;
+          display->background_red_pixel_value_ = 255;
+          display->background_green_pixel_value_ = 255;
+          display->background_blue_pixel_value_ = 255;
         } else if (color_scheme == "gr" || color_scheme == "grays") {
-          chip8.foreground_red_pixel_value_ = 84;
-          chip8.foreground_green_pixel_value_ = 84;
-          chip8.foreground_blue_pixel_value_ = 84;
-          chip8.background_red_pixel_value_ = 169;
-          chip8.background_green_pixel_value_ = 169;
-          chip8.background_blue_pixel_value_ = 169;
+          display->foreground_red_pixel_value_ = 84;
+          display->foreground_green_pixel_value_ = 84;
+          display->foreground_blue_pixel_value_ = 84;
+          display->background_red_pixel_value_ = 169;
+          display->background_green_pixel_value_ = 169;
+          display->background_blue_pixel_value_ = 169;
         } else if (color_scheme == "gb" || color_scheme == "gameboy") {
-          chip8.foreground_red_pixel_value_ = 15;
-          chip8.foreground_green_pixel_value_ = 56;
-          chip8.foreground_blue_pixel_value_ = 15;
-          chip8.background_red_pixel_value_ = 155;
-          chip8.background_green_pixel_value_ = 188;
-          chip8.background_blue_pixel_value_ = 15;
+          display->foreground_red_pixel_value_ = 15;
+          display->foreground_green_pixel_value_ = 56;
+          display->foreground_blue_pixel_value_ = 15;
+          display->background_red_pixel_value_ = 155;
+          display->background_green_pixel_value_ = 188;
+          display->background_blue_pixel_value_ = 15;
         } else if (color_scheme == "blw" || color_scheme == "blue-white") {
-          chip8.foreground_red_pixel_value_ = 5;
-          chip8.foreground_green_pixel_value_ = 65;
-          chip8.foreground_blue_pixel_value_ = 255;
-          chip8.background_red_pixel_value_ = 242;
-          chip8.background_green_pixel_value_ = 242;
-          chip8.background_blue_pixel_value_ = 242;
+          display->foreground_red_pixel_value_ = 5;
+          display->foreground_green_pixel_value_ = 65;
+          display->foreground_blue_pixel_value_ = 255;
+          display->background_red_pixel_value_ = 242;
+          display->background_green_pixel_value_ = 242;
+          display->background_blue_pixel_value_ = 242;
+        }
+      }
+
+      if ( parser.IsCommandLineOption(ips_option->aliases_) ) {
+        const std::string ips_flag = parser.WhichCommandLineOption(
+          ips_option->aliases_);
+        const std::string ips = parser.GetCommandLineOptionArgument(
+          ips_flag);
+
+        if (!ips_option->ArgumentIsValid(ips)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          ips_option->PrintHelp();
+          return 0;
+        }
+
+        if (ips == "max") {
+          chip8.paced_ = false;
+        } else {
+          chip8.instructions_per_second_ = std::stoi(ips);
+        }
+      }
+
+      std::random_device device;
+      uint64_t seed = static_cast<uint64_t>(device()) << 32 | device();
+      if ( parser.IsCommandLineOption(seed_option->aliases_) ) {
+        const std::string seed_flag = parser.WhichCommandLineOption(
+          seed_option->aliases_);
+        const std::string seed_argument = parser.GetCommandLineOptionArgument(
+          seed_flag);
+
+        if (!seed_option->ArgumentIsValid(seed_argument)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          seed_option->PrintHelp();
+          return 0;
+        }
+
+        seed = std::stoull(seed_argument);
+      }
+      chip8.random_.Seed(seed);
+
+      int rewind_megabytes = 4;
+      if ( parser.IsCommandLineOption(rewind_option->aliases_) ) {
+        const std::string rewind_flag = parser.WhichCommandLineOption(
+          rewind_option->aliases_);
+        const std::string rewind = parser.GetCommandLineOptionArgument(
+          rewind_flag);
+
+        if (!rewind_option->ArgumentIsValid(rewind)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          rewind_option->PrintHelp();
+          return 0;
+        }
+
+        rewind_megabytes = std::stoi(rewind);
+      }
+      if (rewind_megabytes > 0) {
+        chip8.rewind_ = new Rewind(static_cast<size_t>(rewind_megabytes) << 20);
+      }
+
+      if ( parser.IsCommandLineOption(run_ahead_option->aliases_) ) {
+        const std::string run_ahead_flag = parser.WhichCommandLineOption(
+          run_ahead_option->aliases_);
+        const std::string run_ahead = parser.GetCommandLineOptionArgument(
+          run_ahead_flag);
+
+        if (!run_ahead_option->ArgumentIsValid(run_ahead)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          run_ahead_option->PrintHelp();
+          return 0;
+        }
+
+        chip8.run_ahead_ = std::stoi(run_ahead);
+      }
+
+      if ( parser.IsCommandLineOption(dispatch_option->aliases_) ) {
+        const std::string dispatch_flag = parser.WhichCommandLineOption(
+          dispatch_option->aliases_);
+        const std::string dispatch = parser.GetCommandLineOptionArgument(
+          dispatch_flag);
+
+        if (!dispatch_option->ArgumentIsValid(dispatch)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          dispatch_option->PrintHelp();
+          return 0;
+        }
+
+        if (dispatch == "table") {
+          chip8.dispatch_ = Chip8::kTableDispatch;
+        } else if (dispatch == "cached") {
+          chip8.dispatch_ = Chip8::kCachedDispatch;
+        } else if (dispatch == "fused") {
+          chip8.dispatch_ = Chip8::kFusedDispatch;
+        } else if (dispatch == "jit") {
+          chip8.dispatch_ = Chip8::kJitDispatch;
+        } else if (dispatch == "compiled") {
+          chip8.dispatch_ = Chip8::kCompiledDispatch;
+        } else {
+          chip8.dispatch_ = Chip8::kSwitchDispatch;
+        }
+      }
+
+      if ( parser.IsCommandLineOption(trace_option->aliases_) ) {
+        const std::string trace_flag = parser.WhichCommandLineOption(
+          trace_option->aliases_);
+        const std::string trace = parser.GetCommandLineOptionArgument(
+          trace_flag);
+
+        if (!trace_option->ArgumentIsValid(trace)) {
+          std::printf("Invalid usage of Chip8 options; correct usage:\n");
+          trace_option->PrintHelp();
+          return 0;
+        }
+
+        if (trace == "print") {
+          chip8.tracing_ = Chip8::kPrintTracing;
+        } else if (trace == "step") {
+          chip8.tracing_ = Chip8::kStepTracing;
+        } else {
+          chip8.tracing_ = Chip8::kNoTracing;
         }
       }
 
@@ -408,6 +658,58 @@ int main(int argc, char* argv[]) {
         Run the ROM
       */
       chip8.Run(path_to_rom);
+
+      std::printf("Seed: %llu (--seed repeats it)\n",
+                  static_cast<unsigned long long>(seed));
+
+      const Chip8::FrameTiming& pacing = chip8.frame_timing_;
+      if (pacing.frames > 0) {
+        const double mean = pacing.late_total/pacing.frames;
+        const double variance
+          = std::max(0., pacing.late_squares/pacing.frames - mean*mean);
+        std::printf(
+          "Frames: %d, late by mean %.2f ms (sd %.2f ms, max %.2f ms), "
+          "%d caught up, %d dropped\n",
+          pacing.frames, 1e3*mean, 1e3*std::sqrt(variance),
+          1e3*pacing.late_max, pacing.caught_up, pacing.dropped);
+      }
+
+      if (chip8.rewind_ && chip8.rewind_->timing_.pushes > 0) {
+        const Rewind::Timing& rewind = chip8.rewind_->timing_;
+        std::printf(
+          "Rewind: %d frames (%.1f s) in %.2f MB, %.0f bytes/frame; "
+          "record mean %.1f us; step back mean %.1f us, max %.1f us\n",
+          chip8.rewind_->Frames(),
+          static_cast<double>(chip8.rewind_->Frames())/Chip8::kFramesPerSecond_,
+          chip8.rewind_->BytesUsed()/1048576., rewind.bytes_total/rewind.pushes,
+          1e6*rewind.push_total/rewind.pushes,
+          rewind.pops ? 1e6*rewind.pop_total/rewind.pops : 0.,
+          1e6*rewind.pop_max);
+      }
+
+      if (chip8.run_ahead_timing_.frames > 0) {
+        const Chip8::RunAheadTiming& run_ahead = chip8.run_ahead_timing_;
+        std::printf(
+          "Run-ahead: %d frames ahead; mean %.1f us, max %.1f us per frame\n",
+          chip8.run_ahead_, 1e6*run_ahead.total/run_ahead.frames,
+          1e6*run_ahead.max);
+      }
+
+      const Display::InputLatency& latency = display->input_latency_;
+      if (latency.responses > 0) {
+        std::printf(
+          "Input latency (key event polled to swap): %d responses, "
+          "mean %.1f ms, max %.1f ms\n",
+          latency.responses, 1e3*latency.total/latency.responses,
+          1e3*latency.max);
+      }
+
+      const Display::UploadTiming& timing = display->upload_timing_;
+      if (timing.uploads > 0) {
+        std::printf(
+          "Texture uploads: %d, mean %.1f us, max %.1f us\n",
+          timing.uploads, 1e6*timing.total/timing.uploads, 1e6*timing.max);
+      }
     }
 
     return 0;
@@ -0,0 +1,50 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_RANDOM_H_
+#define SRC_RANDOM_H_
+
+#include <cstdint>
+
+
+// xoshiro128** (Blackman and Vigna): a fast generator whose whole state is
+// four words, so it's trivially copyable and lives in the machine state,
+// and the same seed always gives the same sequence
+struct Xoshiro128 {
+  uint32_t state_[4];
+
+  // The state from splitmix64 of seed, which is never all zero
+  void Seed(uint64_t seed) {
+    for (int i = 0; i < 4; i += 2) {
+      seed += 0x9E3779B97F4A7C15ULL;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+      z ^= z >> 31;
+      state_[i] = static_cast<uint32_t>(z);
+      state_[i + 1] = static_cast<uint32_t>(z >> 32);
+    }
+  }
+
+  uint32_t Next() {
+    const uint32_t result = Rotate(state_[1]*5, 7)*9;
+    const uint32_t t = state_[1] << 9;
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = Rotate(state_[3], 11);
+    return result;
+  }
+
+ private:
+  static uint32_t Rotate(const uint32_t x, const int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+};
+
+#endif  // SRC_RANDOM_H_
@@ -0,0 +1,197 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include "src/rewind.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+
+const int Rewind::kKeyframeInterval_ = 60;  // A second of frames
+
+Rewind::Rewind(const size_t capacity)
+  : ring_(capacity),
+    since_keyframe_(kKeyframeInterval_),
+    decoded_keyframe_begin_(0),
+    decoded_keyframe_valid_(false) {
+  timing_.pushes = timing_.pops = 0;
+  timing_.push_total = timing_.push_max = 0.;
+  timing_.pop_total = timing_.pop_max = 0.;
+  timing_.bytes_total = 0.;
+}
+
+size_t Rewind::BytesUsed() const {
+  size_t bytes = 0;
+  for (const Entry& entry : entries_) bytes += entry.size;
+  return bytes;
+}
+
+void Rewind::Encode(const std::vector<uint8_t>& image,
+                    const std::vector<uint8_t>* base,
+                    std::vector<uint8_t>* encoded) {
+  const size_t n = image.size();
+  auto At = [&image, base](const size_t i) -> uint8_t {
+    return base ? image[i] ^ (*base)[i] : image[i];
+  };
+  auto Put16 = [encoded](const size_t count) {
+    encoded->push_back(count & 0xFF);
+    encoded->push_back((count >> 8) & 0xFF);
+  };
+
+  encoded->clear();
+  size_t i = 0;
+  while (i < n) {
+    size_t zeros = 0;
+    while (i + zeros < n && zeros < 0xFFFF && At(i + zeros) == 0) ++zeros;
+    i += zeros;
+
+    // Literals run until a run of zeros long enough to pay for a header
+    size_t literals = 0;
+    while (i + literals < n && literals < 0xFFFF) {
+      const size_t j = i + literals;
+      if (At(j) == 0 && j + 3 < n && !At(j + 1) && !At(j + 2) && !At(j + 3)) {
+        break;
+      }
+      ++literals;
+    }
+    Put16(zeros);
+    Put16(literals);
+    for (size_t k = 0; k < literals; ++k) encoded->push_back(At(i + k));
+    i += literals;
+  }
+}
+
+bool Rewind::Decode(const Entry& entry, std::vector<uint8_t>* image) const {
+  size_t at = entry.begin;
+  const size_t end = entry.begin + entry.size;
+  size_t i = 0;
+  while (at < end) {
+    if (at + 4 > end) return false;
+    const size_t zeros = ring_[at] | ring_[at + 1] << 8;
+    const size_t literals = ring_[at + 2] | ring_[at + 3] << 8;
+    at += 4;
+    i += zeros;
+    if (i + literals > image->size() || at + literals > end) return false;
+    for (size_t k = 0; k < literals; ++k) (*image)[i++] ^= ring_[at++];
+  }
+  return i <= image->size();
+}
+
+void Rewind::DropOldest() {
+  entries_.pop_front();
+  while (!entries_.empty() && !entries_.front().keyframe) {
+    entries_.pop_front();
+  }
+}
+
+size_t Rewind::Allocate(const size_t size) {
+  // Entries sit in the ring in the order they were pushed, so the ones after
+  // the newest are the oldest. If the new one doesn't fit before the end it
+  // goes at 0, and the entries it skips past at the end are older than the
+  // ones at 0 it overwrites; both go, with everything that depends on them
+  const size_t end = entries_.empty()
+    ? 0 : entries_.back().begin + entries_.back().size;
+  const bool wrap = end + size > ring_.size();
+  const size_t begin = wrap ? 0 : end;
+  while (!entries_.empty()) {
+    const Entry& oldest = entries_.front();
+    const bool skipped = wrap && oldest.begin >= end;
+    const bool overlaps
+      = oldest.begin < begin + size && oldest.begin + oldest.size > begin;
+    if (!skipped && !overlaps) break;
+    DropOldest();
+  }
+  return begin;
+}
+
+void Rewind::Push(const std::vector<uint8_t>& image) {
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+
+  const bool keyframe = since_keyframe_ >= kKeyframeInterval_
+    || keyframe_.size() != image.size();
+  Encode(image, keyframe ? NULL : &keyframe_, &encoded_);
+  if (encoded_.size() > ring_.size()) {
+    entries_.clear();
+    since_keyframe_ = kKeyframeInterval_;
+    return;
+  }
+  if (keyframe) {
+    keyframe_ = image;
+    since_keyframe_ = 0;
+  }
+  ++since_keyframe_;
+
+  Entry entry;
+  entry.begin = Allocate(encoded_.size());
+  entry.size = encoded_.size();
+  entry.image_size = image.size();
+  entry.keyframe = keyframe;
+  if (!keyframe && entries_.empty()) {
+    // Its keyframe was just overwritten
+    since_keyframe_ = kKeyframeInterval_;
+    return;
+  }
+  if (entry.size > 0) {
+    std::memcpy(&ring_[entry.begin], &encoded_[0], entry.size);
+  }
+  entries_.push_back(entry);
+  decoded_keyframe_valid_ = false;
+
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+  timing_.pushes += 1;
+  timing_.push_total += elapsed.count();
+  timing_.push_max = std::max(timing_.push_max, elapsed.count());
+  timing_.bytes_total += entry.size;
+}
+
+bool Rewind::Pop(std::vector<uint8_t>* image) {
+  if (entries_.empty()) return false;
+  std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+
+  const Entry entry = entries_.back();
+  entries_.pop_back();
+  if (entry.keyframe) {
+    image->assign(entry.image_size, 0);
+  } else {
+    // Start from the keyframe the delta was taken against
+    size_t k = entries_.size();
+    while (k > 0 && !entries_[k - 1].keyframe) --k;
+    if (k == 0) return Corrupt();
+    const Entry& keyframe = entries_[k - 1];
+    if (!decoded_keyframe_valid_
+     || decoded_keyframe_begin_ != keyframe.begin) {
+      decoded_keyframe_.assign(keyframe.image_size, 0);
+      if (!Decode(keyframe, &decoded_keyframe_)) return Corrupt();
+      decoded_keyframe_begin_ = keyframe.begin;
+      decoded_keyframe_valid_ = true;
+    }
+    *image = decoded_keyframe_;
+  }
+  if (!Decode(entry, image)) return Corrupt();
+
+  // Pushes after this start from a new keyframe
+  since_keyframe_ = kKeyframeInterval_;
+
+  std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now() - start;
+  timing_.pops += 1;
+  timing_.pop_total += elapsed.count();
+  timing_.pop_max = std::max(timing_.pop_max, elapsed.count());
+  return true;
+}
+
+bool Rewind::Corrupt() {
+  std::fprintf(stderr, "In Rewind::Pop: history is corrupt, dropping it\n");
+  entries_.clear();
+  decoded_keyframe_valid_ = false;
+  since_keyframe_ = kKeyframeInterval_;
+  return false;
+}
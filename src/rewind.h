@@ -0,0 +1,80 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_REWIND_H_
+#define SRC_REWIND_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+
+// History of snapshots (Chip8::SaveState images) in a fixed amount of
+// memory, newest last, for stepping a machine back a frame at a time. Every
+// kKeyframeInterval_-th snapshot is a keyframe; the rest are stored as the
+// XOR with the latest keyframe, which is mostly zeros since a frame changes
+// only a few bytes, and all are run-length encoded. Entries live in a ring of
+// bytes; when it's full the oldest are dropped, a keyframe together with the
+// deltas that depend on it
+class Rewind {
+ public:
+  explicit Rewind(const size_t capacity);
+
+  static const int kKeyframeInterval_;
+
+  void Push(const std::vector<uint8_t>& image);
+
+  // Newest snapshot, removed from the history; false if it's empty, or if
+  // an entry doesn't decode, in which case the whole history is dropped
+  bool Pop(std::vector<uint8_t>* image);
+
+  int Frames() const { return static_cast<int>(entries_.size()); }
+  size_t BytesUsed() const;
+
+  // Seconds spent in Push and Pop, and bytes stored per Push
+  struct Timing {
+    int pushes, pops;
+    double push_total, push_max, pop_total, pop_max;
+    double bytes_total;
+  };
+  Timing timing_;
+
+ private:
+  struct Entry {
+    size_t begin, size;  // In ring_
+    size_t image_size;
+    bool keyframe;
+  };
+
+  std::vector<uint8_t> ring_;
+  std::deque<Entry> entries_;  // Oldest first
+  int since_keyframe_;
+
+  // Latest keyframe pushed, to take deltas against, and the keyframe last
+  // decoded by Pop, with its position in ring_
+  std::vector<uint8_t> keyframe_;
+  std::vector<uint8_t> decoded_keyframe_;
+  size_t decoded_keyframe_begin_;
+  bool decoded_keyframe_valid_;
+
+  std::vector<uint8_t> encoded_;  // Scratch
+
+  // Runs of zero bytes and of literal bytes: (zeros, literals) as 16-bit
+  // counts, then the literals; Decode XORs the result into image, and
+  // returns false if a run would go past the end of the entry or the image
+  static void Encode(const std::vector<uint8_t>& image,
+                     const std::vector<uint8_t>* base,
+                     std::vector<uint8_t>* encoded);
+  bool Decode(const Entry& entry, std::vector<uint8_t>* image) const;
+  bool Corrupt();  // Pop's failure
+
+  // Room for `size` bytes after the newest entry, dropping old ones
+  size_t Allocate(const size_t size);
+  void DropOldest();
+};
+
+#endif  // SRC_REWIND_H_
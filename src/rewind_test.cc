@@ -0,0 +1,79 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "src/rewind.h"
+
+
+// Regression test of Rewind's ring: pushes many times its capacity of
+// frames whose entries range from a few bytes to a few hundred, so
+// keyframes and deltas of every size wrap around the ring at every offset,
+// and after every push checks that a copy of the history pops back exactly
+// the frames pushed, newest first
+int main() {
+  const size_t kImageSize = 256;
+  const size_t kCapacity = 16*1024;
+  const int kFrames = 20000;
+
+  Rewind rewind(kCapacity);
+  std::vector<std::vector<uint8_t> > pushed;
+  std::vector<uint8_t> image(kImageSize, 0);
+  std::vector<uint8_t> popped;
+  unsigned int seed = 1;
+  auto Random = [&seed]() {
+    seed = seed*1103515245 + 12345;
+    return seed >> 16;
+  };
+  for (int frame = 0; frame < kFrames; ++frame) {
+    // From nearly empty to a quarter full, so some keyframes are smaller
+    // than the deltas that follow them
+    const size_t used = Random()%64;
+    image.assign(kImageSize, 0);
+    for (size_t i = 0; i < used; ++i) {
+      image[Random()%kImageSize] = 1 + Random()%255;
+    }
+    rewind.Push(image);
+    pushed.push_back(image);
+
+    // Rewind part of the way now and then, as the host does
+    if (Random()%50 == 0) {
+      for (unsigned int n = Random()%30; n > 0 && rewind.Frames() > 0; --n) {
+        if (!rewind.Pop(&popped) || popped != pushed.back()) {
+          std::fprintf(stderr, "rewind_test: frame %d popped wrong\n",
+                       frame);
+          return EXIT_FAILURE;
+        }
+        pushed.pop_back();
+      }
+    }
+
+    if (rewind.BytesUsed() > kCapacity) {
+      std::fprintf(stderr, "rewind_test: %zu bytes in a %zu-byte ring\n",
+                   rewind.BytesUsed(), kCapacity);
+      return EXIT_FAILURE;
+    }
+    Rewind history = rewind;
+    const int held = history.Frames();
+    for (int i = 0; i < held; ++i) {
+      if (!history.Pop(&popped) || popped != pushed[pushed.size() - 1 - i]) {
+        std::fprintf(stderr, "rewind_test: after frame %d, frame %d of %d "
+                     "from the newest popped wrong\n", frame, i, held);
+        return EXIT_FAILURE;
+      }
+    }
+    if (history.Pop(&popped)) {
+      std::fprintf(stderr, "rewind_test: after frame %d, popped past the "
+                   "oldest frame\n", frame);
+      return EXIT_FAILURE;
+    }
+  }
+  std::printf("rewind_test: %d frames through a %zu-byte ring popped "
+              "intact\n", kFrames, kCapacity);
+  return EXIT_SUCCESS;
+}
@@ -29,8 +29,11 @@ const char* Shader::kFragment_shader_code_
     "in vec2 frag_tex_coord;\n"
     "layout (location = 0) out vec4 out_color;\n"
     "uniform sampler2D tex;\n"
+    "uniform vec3 foreground;\n"
+    "uniform vec3 background;\n"
     "void main() {\n"
-    "  out_color = texture(tex, frag_tex_coord);\n"
+    "  float lit = texture(tex, frag_tex_coord).r;\n"
+    "  out_color = vec4(mix(background, foreground, lit), 1.0);\n"
     "}\n";
 
 Shader::Shader() {
@@ -78,12 +81,26 @@ Shader::Shader() {
   // Compilation and linking successful, shaders may be deleted
   glDeleteShader(vertex_shader_id);
   glDeleteShader(fragment_shader_id);
+
+  foreground_location_ = glGetUniformLocation(program_id_, "foreground");
+  background_location_ = glGetUniformLocation(program_id_, "background");
 }
 
 void Shader::Use() {
   glUseProgram(program_id_);
 }
 
+void Shader::SetColors(
+  const uint8_t foreground_red, const uint8_t foreground_green,
+  const uint8_t foreground_blue, const uint8_t background_red,
+  const uint8_t background_green, const uint8_t background_blue
+) {
+  glUniform3f(foreground_location_, foreground_red/255.0f,
+              foreground_green/255.0f, foreground_blue/255.0f);
+  glUniform3f(background_location_, background_red/255.0f,
+              background_green/255.0f, background_blue/255.0f);
+}
+
 GLint Shader::CheckShaderErrors(GLuint id, const std::string type) {
   GLint result = GL_FALSE;
   int info_log_length;
@@ -10,6 +10,7 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <cstdint>
 #include <string>
 
 
@@ -19,10 +20,16 @@ class Shader {
   void Use();
   GLint CheckShaderErrors(GLuint shader_id, const std::string);
 
+  // Colors of lit and unlit pixels, as 0-255 RGB; the shader must be in use
+  void SetColors(const uint8_t foreground_red, const uint8_t foreground_green,
+                 const uint8_t foreground_blue, const uint8_t background_red,
+                 const uint8_t background_green, const uint8_t background_blue);
+
  private:
   static const char* kVertex_shader_code_;
   static const char* kFragment_shader_code_;
   GLuint program_id_;
+  GLint foreground_location_, background_location_;
 };
 
 #endif  // SRC_SHADER_H_
@@ -7,11 +7,13 @@
 #ifndef SRC_SOUND_H_
 #define SRC_SOUND_H_
 
+#include "src/frontend.h"
+
 #ifdef __APPLE__
 #  include <AudioUnit/AudioUnit.h>
 
 
-class Sound {
+class Sound : public SoundInterface {
  public:
   void Start(const unsigned int hz);
   void Stop();
@@ -39,7 +41,7 @@ class Sound {
 
 #else
 
-class Sound {
+class Sound : public SoundInterface {
  public:
   void Start(const unsigned int dummy);
   void Stop();
@@ -0,0 +1,28 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+
+// Tracing policies for the instruction handlers; the handlers are templates
+// on one of these, so a NoTrace handler contains no tracing code at all
+struct NoTrace {
+  static const bool kEnabled = false;  // Print state, instructions, screen
+  static const bool kStep = false;  // Wait for ENTER before each instruction
+};
+
+struct PrintTrace {
+  static const bool kEnabled = true;
+  static const bool kStep = false;
+};
+
+struct StepTrace {
+  static const bool kEnabled = true;
+  static const bool kStep = true;
+};
+
+#endif  // SRC_TRACE_H_
@@ -0,0 +1,53 @@
+/* Copyright 2022 Michael E. Rowan
+ *
+ * This file is part of Chip8-Emu.
+ *
+ * License: MIT
+ */
+#ifndef SRC_TRIPLE_BUFFER_H_
+#define SRC_TRIPLE_BUFFER_H_
+
+#include <atomic>
+
+
+// Hands the latest value from one writer thread to one reader thread without
+// locks: the writer fills its back slot and swaps it with the middle one, and
+// the reader swaps its front slot with the middle one when that holds a value
+// it hasn't seen. Neither side ever waits; the reader skips values it was too
+// slow to take
+template <typename T>
+class TripleBuffer {
+ public:
+  explicit TripleBuffer(const T& initial)
+    : back_(0), middle_(1), front_(2) {
+    for (int i = 0; i < 3; ++i) slots_[i] = initial;
+  }
+
+  // Writer: fill Back(), then Publish() it
+  T* Back() { return &slots_[back_]; }
+  void Publish() {
+    back_ = middle_.exchange(back_ | kFresh_, std::memory_order_acq_rel)
+      & kIndex_;
+  }
+
+  // Reader: whether a value was published since the last Acquire, in which
+  // case Front() becomes it
+  bool Acquire() {
+    if (!(middle_.load(std::memory_order_relaxed) & kFresh_)) return false;
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndex_;
+    return true;
+  }
+  const T& Front() const { return slots_[front_]; }
+
+ private:
+  static const int kIndex_, kFresh_;  // Bits of middle_
+  T slots_[3];
+  int back_;
+  std::atomic<int> middle_;
+  int front_;
+};
+
+template <typename T> const int TripleBuffer<T>::kIndex_ = 3;
+template <typename T> const int TripleBuffer<T>::kFresh_ = 4;
+
+#endif  // SRC_TRIPLE_BUFFER_H_